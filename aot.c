@@ -0,0 +1,279 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Static recompiler, turns a rom into C for an aot.h plugin:
+//
+//  chip8-aot -o pong.c c8games/PONG
+//  gcc -O2 -shared -fPIC -fvisibility=hidden -I. pong.c -o pong.so
+//  chip8-batch -a pong.so c8games/PONG
+//
+// The plugin has to be built with the same DEFINES as the program loading
+// it, the machine layout depends on them (chip8_aot_load checks).
+//
+// The walk starts at 0x200 and follows what can be known without running
+// the rom: fall through, 1NNN and 2NNN targets, both ways out of a skip
+// and the return point of every call. BNNN, 00EE and anything a walk
+// can't follow end a path, at run time the generated code looks pc up in
+// a switch of every translated address and leaves it to the interpreter
+// when it isn't one. The walk stays inside the rom, the program can have
+// written anything anywhere else by the time it gets there.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "fileload.h"
+#include "chip8.h"
+
+typedef struct aot_op {
+    chip8_handler handler;
+    const char*   name;
+} aot_op;
+
+#define AOT_OP(NAME) { chip8_op_##NAME, #NAME },
+static const aot_op aotOps[] = { CHIP8_OPS(AOT_OP) };
+#undef AOT_OP
+
+static u8  aotReached[CHIP8_MEMORY_SIZE];
+static u8  aotCovered[CHIP8_MEMORY_SIZE];
+static u16 aotWork[2 * CHIP8_MEMORY_SIZE + 1]; // a reached address pushes at most two
+
+static const aot_op*
+aot_op_find(chip8_handler handler) {
+    for(u32 i = 0; i < SIZEOF_ARRAY(aotOps); i++) {
+        if(aotOps[i].handler == handler) return &aotOps[i];
+    }
+    assert(0);
+    return NULL;
+}
+
+static i32
+aot_is_skip(chip8_handler h) {
+    return h == chip8_op_3XNN || h == chip8_op_4XNN || h == chip8_op_5XY0 ||
+           h == chip8_op_9XY0 || h == chip8_op_EX9E || h == chip8_op_EXA1;
+}
+
+// the ones that call chip8_invalidate
+static i32
+aot_writes(chip8_handler h) {
+    return h == chip8_op_FX33 || h == chip8_op_FX55 || h == chip8_op_5XY2;
+}
+
+// Where the instruction at addr can go next without anything only known
+// at run time, returns the count
+static u32
+aot_successors(const chip8* c, u16 addr, const chip8_instr* in, u16* out) {
+
+    chip8_handler h = in->handler;
+    if(h == chip8_op_1NNN) {
+        out[0] = in->nnn;
+        return 1;
+    }
+    if(h == chip8_op_2NNN) {
+        // 00EE comes back after the call
+        out[0] = in->nnn;
+        out[1] = (u16)(addr + 2);
+        return 2;
+    }
+    if(aot_is_skip(h)) {
+        u16 next = (u16)(addr + 2);
+        i32 wide = c->memory[next] == 0xF0 && c->memory[(u16)(next + 1)] == 0x00;
+        out[0] = next;
+        out[1] = (u16)(next + (wide ? 4 : 2));
+        return 2;
+    }
+    if(h == chip8_op_F000) {
+        out[0] = (u16)(addr + 4);
+        return 1;
+    }
+    if(h == chip8_op_00EE || h == chip8_op_BNNN || h == chip8_op_00FD || h == chip8_op_invalid) {
+        return 0;
+    }
+    out[0] = (u16)(addr + 2);
+    return 1;
+}
+
+// Marks every instruction reachable from PC_START_LOC inside the rom,
+// returns how many
+static u32
+aot_walk(const chip8* c, u32 romEnd) {
+
+    u32 count = 0;
+    u32 top = 0;
+    aotWork[top++] = PC_START_LOC;
+    while(top) {
+        u16 addr = aotWork[--top];
+        if(addr < PC_START_LOC || (u32)addr + 2 > romEnd || aotReached[addr]) continue;
+        aotReached[addr] = 1;
+        count += 1;
+
+        chip8_instr in;
+        chip8_decode(c, addr, &in);
+        // skips and F000 NNNN read the word after, at most one past the rom
+        u32 reads = aot_is_skip(in.handler) || in.handler == chip8_op_F000 ? 4 : 2;
+        for(u32 i = 0; i < reads && addr + i < CHIP8_MEMORY_SIZE; i++) aotCovered[addr + i] = 1;
+
+        u16 next[2];
+        u32 n = aot_successors(c, addr, &in, next);
+        for(u32 i = 0; i < n; i++) {
+            if(!aotReached[next[i]]) aotWork[top++] = next[i];
+        }
+    }
+    return count;
+}
+
+static void
+aot_emit_bytes(FILE* fp, const char* name, const u8* bytes, u32 size) {
+    fprintf(fp, "static const u8 %s[%u] = {", name, size);
+    for(u32 i = 0; i < size; i++) {
+        fprintf(fp, "%s0x%02X,", i % 16 ? " " : "\n    ", bytes[i]);
+    }
+    fprintf(fp, "\n};\n\n");
+}
+
+static void
+aot_emit(FILE* fp, const char* romPath, const chip8* c, u32 romSize, u32 translated) {
+
+    u32 romEnd = PC_START_LOC + romSize;
+    u32 span = romSize + 2;
+    if(PC_START_LOC + span > CHIP8_MEMORY_SIZE) span = CHIP8_MEMORY_SIZE - PC_START_LOC;
+
+    fprintf(fp, "// Generated by chip8-aot from %s, %u instructions. Build with the\n"
+                "// same DEFINES as the program that loads it:\n"
+                "//  gcc -O2 -shared -fPIC -fvisibility=hidden -I<chip8-emu> <this file> -o <plugin>.so\n\n",
+                romPath, translated);
+    fprintf(fp, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n"
+                "#define CHIP8_AOT_PLUGIN\n"
+                "#include \"defs.h\"\n#include \"chip8.h\"\n#include \"aot.h\"\n\n");
+
+    aot_emit_bytes(fp, "aotImage", c->memory + PC_START_LOC, span);
+    aot_emit_bytes(fp, "aotCovered", aotCovered + PC_START_LOC, span);
+
+    for(u32 addr = PC_START_LOC; addr < romEnd; addr++) {
+        if(!aotReached[addr]) continue;
+        chip8_instr in;
+        chip8_decode(c, (u16)addr, &in);
+        fprintf(fp, "static const chip8_instr i_%04X = { chip8_op_%s, 0x%04X, 0x%04X, 0x%X, 0x%X, 0x%X, 0x%02X };\n",
+                addr, aot_op_find(in.handler)->name, in.opcode, in.nnn, in.x, in.y, in.n, in.nn);
+    }
+
+    // Every instruction is a label. pc is already the label's address on
+    // the way in, storing it again lets the compiler see that even where
+    // the switch jumps in. After inlining the handler it knows which of
+    // the successors pc is and the compares fold into plain jumps, only
+    // what depends on state stays a branch.
+    fprintf(fp, "\nstatic u32\naot_run(chip8* c, u32 count, chip8_aot_exit* reason) {\n\n"
+                "    u32 executed = 0;\n"
+                "    goto dispatch;\n\n");
+    // where translated code was made from, writes outside can't change it
+    u32 coverLo = PC_START_LOC + span, coverHi = PC_START_LOC;
+    for(u32 i = PC_START_LOC; i < PC_START_LOC + span; i++) {
+        if(!aotCovered[i]) continue;
+        if(i < coverLo) coverLo = i;
+        coverHi = i + 1;
+    }
+    i32 writes = 0;
+    for(u32 addr = PC_START_LOC; addr < romEnd; addr++) {
+        if(!aotReached[addr]) continue;
+        chip8_instr in;
+        chip8_decode(c, (u16)addr, &in);
+        const aot_op* op = aot_op_find(in.handler);
+        fprintf(fp, "a_%04X: // %04X\n", addr, in.opcode);
+        fprintf(fp, "    if(executed == count) goto budget;\n");
+        fprintf(fp, "    c->pc = 0x%04X;\n", addr);
+        fprintf(fp, "    chip8_op_%s(c, &i_%04X);\n", op->name, addr);
+        fprintf(fp, "    executed += 1;\n");
+        fprintf(fp, "    if(c->pc == 0x%04X) goto stall;\n", addr);
+        if(aot_writes(in.handler)) {
+            // chip8_aot_run enters with the range empty, so it's just this write
+            fprintf(fp, "    if(c->dirtyLo < 0x%04X && c->dirtyHi > 0x%04X) goto written;\n", coverHi, coverLo);
+            fprintf(fp, "    c->dirtyLo = c->dirtyHi = 0;\n");
+            writes = 1;
+        }
+        u16 next[2];
+        u32 n = aot_successors(c, (u16)addr, &in, next);
+        for(u32 i = 0; i < n; i++) {
+            if(aotReached[next[i]]) {
+                fprintf(fp, "    if(c->pc == 0x%04X) goto a_%04X;\n", next[i], next[i]);
+            }
+        }
+        fprintf(fp, "    goto dispatch;\n");
+    }
+
+    fprintf(fp, "\ndispatch:\n    switch(c->pc) {\n");
+    for(u32 addr = PC_START_LOC; addr < romEnd; addr++) {
+        if(aotReached[addr]) fprintf(fp, "        case 0x%04X: goto a_%04X;\n", addr, addr);
+    }
+    fprintf(fp, "    }\n"
+                "    *reason = chip8_aot_missing;\n    return executed;\n"
+                "budget:\n    *reason = chip8_aot_budget;\n    return executed;\n"
+                "stall:\n    *reason = chip8_aot_stall;\n    return executed;\n");
+    if(writes) {
+        fprintf(fp, "written:\n    *reason = chip8_aot_written;\n    return executed;\n");
+    }
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "__attribute__((visibility(\"default\"))) const chip8_aot_plugin chip8AotPlugin = {\n"
+                "    CHIP8_AOT_VERSION, sizeof(chip8), %u, %u, aotImage, aotCovered, %u, aot_run,\n"
+                "};\n", romSize, span, translated);
+}
+
+static void
+usage(const char* name) {
+    printf("usage: %s [-o out.c] rom\n", name);
+}
+
+int
+main(int argc, char** argv) {
+
+    const char* outPath = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch(opt) {
+            case 'o': outPath = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char* romPath = argv[optind];
+    size_t romSize;
+    u8* rom = load_binary_file((char*)romPath, &romSize);
+    if(!rom) {
+        printf("%s not found\n", romPath);
+        return EXIT_FAILURE;
+    }
+    // decoded the way the machine sees it right after boot
+    chip8* c = malloc(sizeof(chip8));
+    assert(c);
+    chip8_init(c);
+    if(!chip8_load_rom(c, rom, romSize)) {
+        printf("%s: Too large file!\n", romPath);
+        return EXIT_FAILURE;
+    }
+    u32 translated = aot_walk(c, PC_START_LOC + (u32)romSize);
+
+    FILE* fp = outPath ? fopen(outPath, "w") : stdout;
+    if(!fp) {
+        printf("failed to open %s\n", outPath);
+        return EXIT_FAILURE;
+    }
+    aot_emit(fp, romPath, c, (u32)romSize, translated);
+    if(outPath) {
+        fclose(fp);
+        printf("%s: %u instructions translated, %zu rom bytes\n", romPath, translated, romSize);
+    }
+    free(c);
+    free(rom);
+    return EXIT_SUCCESS;
+}
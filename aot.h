@@ -0,0 +1,153 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef AOT_H
+#define AOT_H
+
+// Ahead of time recompiled roms, for hosts that don't allow the runtime
+// recompiler in jit.h (no writable + executable memory). chip8-aot (aot.c)
+// walks a rom's control flow from 0x200 and writes it out as C: one label
+// per reachable instruction, calling the same chip8_op_* handler
+// chip8_cycle would with the decoded operands as constants, so the C
+// compiler inlines and folds them, and following the branches it can see
+// with direct gotos. Built as a shared object against the same chip8.h it's
+// loaded with chip8_aot_load and run with chip8_aot_run in place of
+// chip8_run.
+//
+// Only code the walk could reach is translated. Everything else (BNNN
+// targets, code the program writes itself) runs on the interpreter until pc
+// is back on translated code. A write over bytes the translation was made
+// from puts the machine on the interpreter until they read the same again.
+
+#include "chip8.h"
+
+#define CHIP8_AOT_VERSION 1
+
+typedef enum chip8_aot_exit {
+    chip8_aot_budget,  // ran all it was given
+    chip8_aot_stall,   // an instruction left pc where it was, stall or trap
+    chip8_aot_missing, // pc has no translation
+    chip8_aot_written, // memory was written, it may have been code
+} chip8_aot_exit;
+
+// Entered with the dirty range empty, only leaves it set when it stops
+// with chip8_aot_written
+typedef u32 (*chip8_aot_run_fn)(chip8* c, u32 count, chip8_aot_exit* reason);
+
+// What a plugin exports as chip8AotPlugin
+typedef struct chip8_aot_plugin {
+    u32              version;     // CHIP8_AOT_VERSION
+    u32              machineSize; // sizeof(chip8) it was built with
+    u32              romSize;
+    u32              span;        // image and covered, the rom and the word after it
+    const u8*        image;       // memory from PC_START_LOC as translated
+    const u8*        covered;     // 1 where translated code depends on image
+    u32              translated;  // instructions
+    chip8_aot_run_fn run;
+} chip8_aot_plugin;
+
+#if defined(LINUX_PLATFORM) && !defined(CHIP8_AOT_PLUGIN)
+#define CHIP8_AOT_AVAILABLE 1
+
+#include <dlfcn.h>
+
+typedef struct chip8_aot {
+    void*                   library;
+    const chip8_aot_plugin* plugin;
+} chip8_aot;
+
+// returns 0 (and says why) if the plugin can't be used with this build
+static i32
+chip8_aot_load(chip8_aot* a, const char* path) {
+
+    // without a slash dlopen searches the library path instead
+    char local[1024];
+    if(!strchr(path, '/')) {
+        snprintf(local, sizeof(local), "./%s", path);
+        path = local;
+    }
+    a->library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!a->library) {
+        printf("%s\n", dlerror());
+        return 0;
+    }
+    a->plugin = dlsym(a->library, "chip8AotPlugin");
+    if(!a->plugin) {
+        printf("%s: not a chip8-aot plugin\n", path);
+        goto fail;
+    }
+    if(a->plugin->version != CHIP8_AOT_VERSION || a->plugin->machineSize != sizeof(chip8)) {
+        printf("%s: built against a different chip8.h, rebuild it\n", path);
+        goto fail;
+    }
+    return 1;
+
+fail:
+    dlclose(a->library);
+    a->library = NULL;
+    a->plugin = NULL;
+    return 0;
+}
+
+static void
+chip8_aot_dispose(chip8_aot* a) {
+    if(a->library) dlclose(a->library);
+    a->library = NULL;
+    a->plugin = NULL;
+}
+
+// whether the plugin was made from this rom
+static i32
+chip8_aot_matches(const chip8_aot_plugin* p, const u8* rom, size_t size) {
+    return p->romSize == size && memcmp(p->image, rom, size) == 0;
+}
+
+// Whether the writes in the dirty range changed a byte translated code
+// was made from. The range only gets cleared while nothing did, so it
+// always holds every write that could have.
+static i32
+aot_stale(const chip8_aot_plugin* p, const chip8* c) {
+    u32 lo = c->dirtyLo > PC_START_LOC ? c->dirtyLo : PC_START_LOC;
+    u32 hi = PC_START_LOC + p->span;
+    if(c->dirtyHi < hi) hi = c->dirtyHi;
+    for(u32 i = lo; i < hi; i++) {
+        if(p->covered[i - PC_START_LOC] && c->memory[i] != p->image[i - PC_START_LOC]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Same contract as chip8_run, c must have been booted from the plugin's rom
+// (chip8_aot_matches)
+static u32
+chip8_aot_run(const chip8_aot_plugin* p, chip8* c, u32 count) {
+
+    u32 remaining = count;
+    if(c->trap) return 0;
+    while(remaining) {
+        if(c->dirtyLo < c->dirtyHi) {
+            if(aot_stale(p, c)) {
+                // the range stays, the next call looks again
+                remaining -= chip8_run(c, remaining);
+                break;
+            }
+            c->dirtyLo = c->dirtyHi = 0;
+        }
+
+        chip8_aot_exit reason;
+        remaining -= p->run(c, remaining, &reason);
+        if(reason == chip8_aot_budget || reason == chip8_aot_stall) break;
+        if(reason == chip8_aot_missing && remaining) {
+            u16 pc = c->pc;
+            remaining -= chip8_run(c, 1);
+            if(c->pc == pc) break;
+        }
+    }
+    return count - remaining;
+}
+
+#endif
+
+#endif /* AOT_H */
@@ -0,0 +1,149 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <math.h>
+
+#include "defs.h"
+#include "chip8.h"
+
+// Sound. Every emulated tick renders exactly its share of samples
+// (sampleRate / tickRate, the fraction carried over) from the machine as
+// it is at the end of the tick, so a beep starts and stops on the sample
+// where its tick begins and ends, however the host schedules things.
+//
+// The machine plays its 128 bit pattern (XO-CHIP F002, a square wave
+// until a program loads one) at 4000 * 2^((pitch - 64) / 48) bits a
+// second while the sound timer is above 0. The timer has already been
+// decremented for the tick, so like on the COSMAC VIP a sound timer of 1
+// is too short to be heard.
+//
+// Samples go from the emulation thread to the audio callback through a
+// lock free single producer, single consumer ring. The producer never
+// waits, it drops what doesn't fit (fast forward), the consumer plays
+// silence when it runs dry and counts it.
+
+#define CHIP8_AUDIO_AMPLITUDE 0.25f
+
+typedef struct chip8_audio_ring {
+    float* samples;
+    u32    capacity; // power of two
+    u32    head;     // written by the producer only
+    u32    tail;     // written by the consumer only
+} chip8_audio_ring;
+
+typedef struct chip8_audio {
+    chip8_audio_ring ring;
+    u32    sampleRate;
+    u32    limit;          // most samples buffered at once, bounds latency
+    double samplesPerTick;
+    double carry;          // fraction of a sample owed to the next tick
+    double phase;          // position in the pattern, in bits
+
+    u64    underruns;      // samples of silence played for lack of data
+    u64    dropped;        // samples that didn't fit
+} chip8_audio;
+
+// latency is how many samples are kept queued between the emulation and
+// the device, the ring is sized to fit it and a tick on top
+static void
+chip8_audio_init(chip8_audio* a, u32 sampleRate, double tickRate, u32 latency) {
+
+    memset(a, 0, sizeof(*a));
+    a->sampleRate = sampleRate;
+    a->samplesPerTick = sampleRate / tickRate;
+    a->limit = latency + (u32)ceil(a->samplesPerTick);
+
+    u32 capacity = 64;
+    while(capacity < a->limit) capacity *= 2;
+    a->ring.samples = calloc(capacity, sizeof(float));
+    assert(a->ring.samples);
+    a->ring.capacity = capacity;
+    // start out with the latency worth of silence so the first tick
+    // doesn't arrive to an empty ring
+    a->ring.head = latency;
+}
+
+static void
+chip8_audio_dispose(chip8_audio* a) {
+    free(a->ring.samples);
+    a->ring.samples = NULL;
+}
+
+// how many samples the next tick renders, advances the carry
+static u32
+chip8_audio_tick_samples(chip8_audio* a) {
+    double want = a->samplesPerTick + a->carry;
+    u32 count = (u32)want;
+    a->carry = want - count;
+    return count;
+}
+
+// Renders count samples of what the machine is playing
+static void
+chip8_audio_render(chip8_audio* a, const chip8* c, float* out, u32 count) {
+
+    if(c->soundTimer == 0) {
+        memset(out, 0, count * sizeof(float));
+        a->phase = 0; // the next beep starts at the top of the pattern
+        return;
+    }
+    double rate = 4000.0 * pow(2.0, ((double)c->pitch - 64.0) / 48.0);
+    double step = rate / a->sampleRate;
+    double phase = a->phase;
+    for(u32 i = 0; i < count; i++) {
+        u32 bit = (u32)phase;
+        i32 on = (c->audioPattern[bit >> 3] >> (7 - (bit & 7))) & 1;
+        out[i] = on ? CHIP8_AUDIO_AMPLITUDE : -CHIP8_AUDIO_AMPLITUDE;
+        phase += step;
+        if(phase >= 128.0) phase -= 128.0;
+    }
+    a->phase = phase;
+}
+
+// Producer side, renders one tick into the ring
+static void
+chip8_audio_tick(chip8_audio* a, const chip8* c) {
+
+    u32 count = chip8_audio_tick_samples(a);
+    chip8_audio_ring* r = &a->ring;
+    u32 head = r->head;
+    u32 tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    u32 room = a->limit - (head - tail);
+    if(head - tail > a->limit) room = 0;
+    if(count > room) {
+        a->dropped += count - room;
+        count = room;
+    }
+
+    // straight into the ring, in at most two pieces around the end
+    u32 at = head & (r->capacity - 1);
+    u32 first = r->capacity - at < count ? r->capacity - at : count;
+    chip8_audio_render(a, c, r->samples + at, first);
+    chip8_audio_render(a, c, r->samples, count - first);
+    __atomic_store_n(&r->head, head + count, __ATOMIC_RELEASE);
+}
+
+// Consumer side, always fills all of out
+static void
+chip8_audio_pull(chip8_audio* a, float* out, u32 count) {
+
+    chip8_audio_ring* r = &a->ring;
+    u32 tail = r->tail;
+    u32 head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    u32 available = head - tail;
+    u32 take = available < count ? available : count;
+    for(u32 i = 0; i < take; i++) {
+        out[i] = r->samples[(tail + i) & (r->capacity - 1)];
+    }
+    if(take < count) {
+        memset(out + take, 0, (count - take) * sizeof(float));
+        __atomic_fetch_add(&a->underruns, count - take, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&r->tail, tail + take, __ATOMIC_RELEASE);
+}
+
+#endif /* AUDIO_H */
@@ -0,0 +1,412 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Headless batch runner, runs many independent machines per process
+// on a work stealing thread pool. No SDL, no GL, no display needed.
+//
+//  chip8-batch [-j threads] [-n instances] [-c instructions] [-t timeout ms]
+//              [-r instructions per timer tick] [-o dump dir] [-l state]
+//              [-i input log] [-x] [-a plugin] rom...
+//
+//  -x runs the machines on the x86-64 recompiler (jit.h) where available
+//  -a loads a plugin written by chip8-aot (aot.h), machines running the
+//     rom it was made from run on it, the rest as without
+//  -o also gets <rom>.<instance>.trace for every machine that trapped
+//  -l resumes every machine from a save state instead of booting the rom,
+//     the rom path is still used to name the outputs
+//  -i replays an input log (recorded with chip8 -R) on every machine at
+//     full speed and checks the final state against the recorded one,
+//     -c, -t, -r, -x and -a don't apply
+//
+// Built with -DCHIP8_PROFILE every machine is profiled, with -o the report
+// and folded stacks go next to the dumps as <rom>.<instance>.profile/.folded
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "defs.h"
+#include "fileload.h"
+#include "chip8.h"
+#include "threadpool.h"
+#include "jit.h"
+#include "aot.h"
+#include "savestate.h"
+#include "inputlog.h"
+
+typedef enum batch_status {
+    batch_status_budget,  // ran the whole instruction budget
+    batch_status_halted,  // stuck on itself (jump to self, key wait with no input)
+    batch_status_timeout, // wall clock limit hit
+    batch_status_replayed, // input log replayed, same final state as recorded
+    batch_status_diverged, // input log replayed, final state differs
+    batch_status_trapped, // guest error, see the trace dump
+} batch_status;
+
+static const char* batch_status_names[] = {
+    "budget",
+    "halted",
+    "timeout",
+    "replayed",
+    "diverged",
+    "trapped",
+};
+
+typedef struct batch_rom {
+    char*  path;
+    u8*    data;
+    size_t size;
+    const chip8_aot_plugin* aot; // translated ahead of time, -a
+} batch_rom;
+
+typedef struct batch_job {
+    const batch_rom* rom;
+    u32              instance;
+
+    batch_status     status;
+    u64              instructions;
+    u64              canvasHash;
+    double           seconds;
+} batch_job;
+
+typedef struct batch_config {
+    u64         budget;
+    u64         timeoutNs;
+    u32         instructionsPerTick;
+    const char* dumpDir;
+    i32         useJit;
+    const char* aotPath;
+    chip8_state resume;
+    i32         useResume;
+    chip8_input_log replay;
+    i32         useReplay;
+} batch_config;
+
+static batch_config config = {
+    .budget = 1000000,
+    .timeoutNs = 0,
+    .instructionsPerTick = 10,
+    .dumpDir = NULL,
+    .useJit = 0,
+};
+
+static u64
+time_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static u64
+hash_fnv1a(const void* bytes, size_t size) {
+    const u8* data = bytes;
+    u64 hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static const char*
+path_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// binary pbm at the current resolution, pixels lit on any plane are black
+static void
+batch_dump_canvas(const batch_job* job, const chip8* c) {
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.%u.pbm",
+            config.dumpDir, path_basename(job->rom->path), job->instance);
+
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        printf("failed to open %s\n", path);
+        return;
+    }
+    u32 width = c->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    u32 height = c->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    fprintf(fp, "P4\n%u %u\n", width, height);
+    for(u32 y = 0; y < height; y++) {
+        u8 packed[CHIP8_HIRES_WIDTH / 8];
+        for(u32 i = 0; i < width / 8; i++) {
+            u64 lit = 0;
+            for(u32 p = 0; p < CHIP8_PLANES; p++) lit |= c->canvas[p][i / 8][y];
+            packed[i] = (u8)(lit >> (56 - (i % 8) * 8));
+        }
+        fwrite(packed, width / 8, 1, fp);
+    }
+    fclose(fp);
+}
+
+static void
+batch_dump_trace(const batch_job* job, chip8* c) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.%u.trace",
+            config.dumpDir, path_basename(job->rom->path), job->instance);
+    chip8_trace_dump(&c->trace, path);
+}
+
+#ifdef CHIP8_PROFILE
+static void
+batch_dump_profile(const batch_job* job, const chip8_profile* profile) {
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.%u.folded",
+            config.dumpDir, path_basename(job->rom->path), job->instance);
+    chip8_profile_write_folded(profile, path);
+
+    snprintf(path, sizeof(path), "%s/%s.%u.profile",
+            config.dumpDir, path_basename(job->rom->path), job->instance);
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        printf("failed to open %s\n", path);
+        return;
+    }
+    chip8_profile_report(profile, fp);
+    fclose(fp);
+}
+#endif
+
+// Runs the machine until the budget is used up, it stalls or the timeout
+// hits, returns the instructions executed.
+static u64
+batch_run_budget(batch_job* job, chip8* c, u64 start) {
+
+#ifdef CHIP8_JIT_AVAILABLE
+    chip8_jit* jit = config.useJit && !job->rom->aot ? jit_create() : NULL;
+#endif
+
+    u64 executed = 0;
+    u32 tickCounter = 0;
+    job->status = batch_status_budget;
+
+    while(executed < config.budget) {
+        u64 left = config.budget - executed;
+        u32 chunk = config.instructionsPerTick - tickCounter;
+        if(chunk > left) chunk = (u32)left;
+
+        u32 ran;
+#ifdef CHIP8_AOT_AVAILABLE
+        if(job->rom->aot) {
+            ran = chip8_aot_run(job->rom->aot, c, chunk);
+        } else
+#endif
+#ifdef CHIP8_JIT_AVAILABLE
+        if(jit) {
+            ran = jit_run(jit, c, chunk);
+        } else
+#endif
+        {
+            ran = chip8_run(c, chunk);
+        }
+        executed += ran;
+        tickCounter += ran;
+
+        if(tickCounter == config.instructionsPerTick) {
+            tickCounter = 0;
+            chip8_tick_timers(c);
+        }
+        if(ran < chunk) {
+            job->status = c->trap ? batch_status_trapped : batch_status_halted;
+            break;
+        }
+        if(config.timeoutNs && (executed & ~0x3FFFull) != ((executed - ran) & ~0x3FFFull) &&
+                time_now_ns() - start > config.timeoutNs) {
+            job->status = batch_status_timeout;
+            break;
+        }
+    }
+
+#ifdef CHIP8_JIT_AVAILABLE
+    if(jit) jit_dispose(jit);
+#endif
+    return executed;
+}
+
+static void
+batch_run_job(void* arg) {
+
+    batch_job* job = arg;
+    chip8* c = malloc(sizeof(chip8));
+    assert(c);
+
+    chip8_init(c);
+    chip8_load_rom(c, job->rom->data, job->rom->size);
+    if(config.useResume) {
+        chip8_load_state(c, &config.resume);
+    }
+#ifdef CHIP8_PROFILE
+    c->profile = chip8_profile_create();
+#endif
+
+    u64 start = time_now_ns();
+    if(config.useReplay) {
+        job->instructions = chip8_input_log_replay(&config.replay, c);
+        job->status = chip8_state_hash(c) == config.replay.header.finalHash ?
+            batch_status_replayed : batch_status_diverged;
+    } else {
+        job->instructions = batch_run_budget(job, c, start);
+    }
+    job->seconds = (double)(time_now_ns() - start) / 1e9;
+    job->canvasHash = hash_fnv1a(c->canvas, sizeof(c->canvas));
+    if(config.dumpDir) {
+        batch_dump_canvas(job, c);
+        if(c->trap) batch_dump_trace(job, c);
+    }
+#ifdef CHIP8_PROFILE
+    if(config.dumpDir) {
+        batch_dump_profile(job, c->profile);
+    }
+    free(c->profile);
+#endif
+    free(c);
+}
+
+static void
+usage(const char* name) {
+    printf("usage: %s [-j threads] [-n instances] [-c instructions] [-t timeout ms]\n"
+           "          [-r instructions per timer tick] [-o dump dir] [-l state] [-i input log] [-x]\n"
+           "          [-a plugin] rom...\n", name);
+}
+
+int
+main(int argc, char** argv) {
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 threads = cpus > 0 ? (u32)cpus : 1;
+    u32 instances = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:n:c:t:r:o:l:i:a:xh")) != -1) {
+        switch(opt) {
+            case 'j': threads = (u32)strtoul(optarg, NULL, 10); break;
+            case 'n': instances = (u32)strtoul(optarg, NULL, 10); break;
+            case 'c': config.budget = strtoull(optarg, NULL, 10); break;
+            case 't': config.timeoutNs = strtoull(optarg, NULL, 10) * 1000000ull; break;
+            case 'r': config.instructionsPerTick = (u32)strtoul(optarg, NULL, 10); break;
+            case 'o': config.dumpDir = optarg; break;
+            case 'x': config.useJit = 1; break;
+            case 'a': config.aotPath = optarg; break;
+            case 'i':
+                if(!chip8_input_log_read(&config.replay, optarg)) return EXIT_FAILURE;
+                config.useReplay = 1;
+                break;
+            case 'l':
+                {
+                    chip8 scratch;
+                    chip8_init(&scratch);
+                    if(!chip8_load_state_file(&scratch, optarg)) return EXIT_FAILURE;
+                    chip8_save_state(&scratch, &config.resume);
+                    config.useResume = 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(optind >= argc || instances == 0 || config.instructionsPerTick == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(config.useReplay && config.useResume) {
+        printf("input logs start from boot, can't combine -i with -l\n");
+        return EXIT_FAILURE;
+    }
+#ifndef CHIP8_JIT_AVAILABLE
+    if(config.useJit) {
+        printf("jit not available on this platform, interpreting\n");
+    }
+#endif
+#ifndef CHIP8_AOT_AVAILABLE
+    if(config.aotPath) {
+        printf("plugins not available on this platform, interpreting\n");
+        config.aotPath = NULL;
+    }
+#endif
+#ifdef CHIP8_PROFILE
+    if(config.useJit || config.aotPath) {
+        printf("profiler only sees the interpreter, ignoring -x and -a\n");
+        config.useJit = 0;
+        config.aotPath = NULL;
+    }
+#endif
+#ifdef CHIP8_AOT_AVAILABLE
+    chip8_aot aot = {0};
+    if(config.aotPath && !chip8_aot_load(&aot, config.aotPath)) {
+        return EXIT_FAILURE;
+    }
+#endif
+
+    u32 romCount = (u32)(argc - optind);
+    batch_rom* roms = calloc(romCount, sizeof(batch_rom));
+    assert(roms);
+    for(u32 i = 0; i < romCount; i++) {
+        roms[i].path = argv[optind + i];
+        roms[i].data = load_binary_file(roms[i].path, &roms[i].size);
+        if(!roms[i].data) {
+            printf("%s not found\n", roms[i].path);
+            return EXIT_FAILURE;
+        }
+        if(roms[i].size >= CHIP8_MEMORY_SIZE - PC_START_LOC) {
+            printf("%s: Too large file!\n", roms[i].path);
+            return EXIT_FAILURE;
+        }
+#ifdef CHIP8_AOT_AVAILABLE
+        if(aot.plugin && !config.useReplay) {
+            if(chip8_aot_matches(aot.plugin, roms[i].data, roms[i].size)) {
+                roms[i].aot = aot.plugin;
+            } else {
+                printf("%s: %s was made from another rom, not using it\n", roms[i].path, config.aotPath);
+            }
+        }
+#endif
+    }
+
+    u32 jobCount = romCount * instances;
+    batch_job* jobs = calloc(jobCount, sizeof(batch_job));
+    assert(jobs);
+
+    threadpool pool;
+    threadpool_init(&pool, threads);
+
+    u64 start = time_now_ns();
+    for(u32 i = 0; i < jobCount; i++) {
+        jobs[i].rom = &roms[i / instances];
+        jobs[i].instance = i % instances;
+        threadpool_submit(&pool, batch_run_job, &jobs[i]);
+    }
+    threadpool_wait(&pool);
+    double seconds = (double)(time_now_ns() - start) / 1e9;
+    threadpool_dispose(&pool);
+
+    u64 total = 0;
+    for(u32 i = 0; i < jobCount; i++) {
+        const batch_job* job = &jobs[i];
+        printf("%s %u %s %" PRIu64 " %016" PRIx64 " %.6f\n",
+                job->rom->path, job->instance, batch_status_names[job->status],
+                job->instructions, job->canvasHash, job->seconds);
+        total += job->instructions;
+    }
+    printf("# %u machines on %u threads, %" PRIu64 " instructions in %.3fs (%.2f MIPS)\n",
+            jobCount, pool.count, total, seconds, (double)total / seconds / 1e6);
+
+    for(u32 i = 0; i < romCount; i++) {
+        free(roms[i].data);
+    }
+    free(roms);
+    free(jobs);
+#ifdef CHIP8_AOT_AVAILABLE
+    chip8_aot_dispose(&aot);
+#endif
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,422 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Interpreter benchmark. Builds small synthetic ROMs that each hammer one
+// class of opcodes in an endless loop, runs every one of them headless a
+// number of times and reports ns per instruction and MIPS per class,
+// with the spread between runs so regressions can be told from noise.
+//
+//  chip8-bench [-r repetitions] [-c instructions] [-x] [-l lanes] [-w rom dir] [class...]
+//
+//  -x runs the ROMs on the x86-64 recompiler (jit.h) where available
+//  -l runs every ROM on that many machines in lockstep (lockstep.h), the
+//     instruction count is over all of them
+//  -w also writes the generated ROMs to rom dir, named after their class
+//
+// One line per class on stdout, space separated, header starts with '#'.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "fileload.h"
+#include "chip8.h"
+#include "scheduler.h"
+#include "jit.h"
+#include "lockstep.h"
+
+#define BENCH_ROM_SIZE 256
+
+typedef struct bench_rom {
+    u8  data[BENCH_ROM_SIZE];
+    u32 size;
+} bench_rom;
+
+static void
+bench_emit(bench_rom* rom, u16 opcode) {
+    assert(rom->size + 2 <= BENCH_ROM_SIZE);
+    rom->data[rom->size++] = opcode >> 8;
+    rom->data[rom->size++] = opcode & 0xFF;
+}
+
+static u16
+bench_here(const bench_rom* rom) {
+    return PC_START_LOC + rom->size;
+}
+
+// 8xyN arithmetic and logic, 7xNN, 6xNN
+static void
+bench_build_alu(bench_rom* rom) {
+    bench_emit(rom, 0x6001); // V0 = 1
+    bench_emit(rom, 0x6103); // V1 = 3
+    bench_emit(rom, 0x6207); // V2 = 7
+    bench_emit(rom, 0x630F); // V3 = F
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0x8014); // V0 += V1
+    bench_emit(rom, 0x8125); // V1 -= V2
+    bench_emit(rom, 0x8231); // V2 |= V3
+    bench_emit(rom, 0x8302); // V3 &= V0
+    bench_emit(rom, 0x8013); // V0 ^= V1
+    bench_emit(rom, 0x8116); // V1 >>= 1
+    bench_emit(rom, 0x820E); // V2 <<= 1
+    bench_emit(rom, 0x8317); // V3 = V1 - V3
+    bench_emit(rom, 0x8020); // V0 = V2
+    bench_emit(rom, 0x7001); // V0 += 1
+    bench_emit(rom, 0x7105); // V1 += 5
+    bench_emit(rom, 0x6207); // V2 = 7
+    bench_emit(rom, 0x1000 | loop);
+}
+
+// conditional skips, both taken and not, and call/return
+static void
+bench_build_branch(bench_rom* rom) {
+    bench_emit(rom, 0x6000); // V0 = 0
+    bench_emit(rom, 0x6101); // V1 = 1
+    bench_emit(rom, 0x1000 | (bench_here(rom) + 6));
+    u16 sub = bench_here(rom);
+    bench_emit(rom, 0x3100); // not taken
+    bench_emit(rom, 0x00EE);
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0x3000); // taken
+    bench_emit(rom, 0x7001);
+    bench_emit(rom, 0x4001); // taken
+    bench_emit(rom, 0x7001);
+    bench_emit(rom, 0x5010); // not taken
+    bench_emit(rom, 0x9010); // taken
+    bench_emit(rom, 0x7001);
+    bench_emit(rom, 0x4000); // not taken
+    bench_emit(rom, 0x2000 | sub);
+    bench_emit(rom, 0x2000 | sub);
+    bench_emit(rom, 0x1000 | loop);
+}
+
+// BCD, register dump and load, all on data away from the code
+static void
+bench_build_memory(bench_rom* rom) {
+    bench_emit(rom, 0x6012);
+    bench_emit(rom, 0x6134);
+    bench_emit(rom, 0x6256);
+    bench_emit(rom, 0x63FE);
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0xAE00); // I = E00
+    bench_emit(rom, 0xF333); // BCD V3
+    bench_emit(rom, 0xF355); // store V0..V3
+    bench_emit(rom, 0xF165); // load V0..V1
+    bench_emit(rom, 0xF033); // BCD V0
+    bench_emit(rom, 0xF365); // load V0..V3
+    bench_emit(rom, 0xF11E); // I += V1
+    bench_emit(rom, 0xF055); // store V0
+    bench_emit(rom, 0x63FE); // V3 = FE
+    bench_emit(rom, 0x1000 | loop);
+}
+
+// sprite drawing of every height, moving so rows and columns vary
+static void
+bench_build_draw(bench_rom* rom) {
+    bench_emit(rom, 0x6000); // V0 = 0, x
+    bench_emit(rom, 0x6100); // V1 = 0, y
+    bench_emit(rom, 0x6209); // V2 = 9, glyph
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0xF229); // I = font glyph V2
+    bench_emit(rom, 0xD015);
+    bench_emit(rom, 0x7003);
+    bench_emit(rom, 0x7105);
+    bench_emit(rom, 0xA000 | (loop + 28));
+    bench_emit(rom, 0xD01F);
+    bench_emit(rom, 0x7007);
+    bench_emit(rom, 0xD018);
+    bench_emit(rom, 0x7102);
+    bench_emit(rom, 0xD011);
+    bench_emit(rom, 0x3040); // clear now and then
+    bench_emit(rom, 0x1000 | loop);
+    bench_emit(rom, 0x00E0);
+    bench_emit(rom, 0x1000 | loop);
+    for(u32 i = 0; i < 8; i++) { // sprite data, 16 bytes
+        bench_emit(rom, 0xA55A ^ (u16)(i * 0x1111));
+    }
+}
+
+// a bit of everything, roughly in the proportions games use
+static void
+bench_build_mixed(bench_rom* rom) {
+    bench_emit(rom, 0x6000);
+    bench_emit(rom, 0x6100);
+    bench_emit(rom, 0x6205);
+    bench_emit(rom, 0x1000 | (bench_here(rom) + 6));
+    u16 sub = bench_here(rom);
+    bench_emit(rom, 0x8024); // V0 += V2
+    bench_emit(rom, 0x00EE);
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0x2000 | sub);
+    bench_emit(rom, 0x7101);
+    bench_emit(rom, 0x8312);
+    bench_emit(rom, 0x4300);
+    bench_emit(rom, 0x7301);
+    bench_emit(rom, 0xF329);
+    bench_emit(rom, 0xD015);
+    bench_emit(rom, 0xAE00);
+    bench_emit(rom, 0xF233);
+    bench_emit(rom, 0xF265);
+    bench_emit(rom, 0x9010);
+    bench_emit(rom, 0x7001);
+    bench_emit(rom, 0x8106);
+    bench_emit(rom, 0x6205);
+    bench_emit(rom, 0x1000 | loop);
+}
+
+typedef struct bench_class {
+    const char* name;
+    void        (*build)(bench_rom* rom);
+} bench_class;
+
+// SUPER-CHIP/XO-CHIP screen work: hires 16x16 sprites on both planes and
+// a scroll in every direction each pass, the way modern games redraw
+static void
+bench_build_hires(bench_rom* rom) {
+    bench_emit(rom, 0x00FF); // hires
+    bench_emit(rom, 0xF301); // both planes
+    bench_emit(rom, 0x6000); // V0 = 0, x
+    bench_emit(rom, 0x6100); // V1 = 0, y
+    u16 loop = bench_here(rom);
+    bench_emit(rom, 0xA000 | (loop + 24));
+    bench_emit(rom, 0xD010); // 16x16 on both planes
+    bench_emit(rom, 0x00C3); // down 3
+    bench_emit(rom, 0x00FB); // right 4
+    bench_emit(rom, 0xD017);
+    bench_emit(rom, 0x00D2); // up 2
+    bench_emit(rom, 0x00FC); // left 4
+    bench_emit(rom, 0x7005);
+    bench_emit(rom, 0x7103);
+    bench_emit(rom, 0x8102);
+    bench_emit(rom, 0x1000 | loop);
+    bench_emit(rom, 0x00E0);
+    for(u32 i = 0; i < 32; i++) { // sprite data, 64 bytes, two planes of 16x16
+        bench_emit(rom, 0xA55A ^ (u16)(i * 0x1111));
+    }
+}
+
+static const bench_class benchClasses[] = {
+    { "alu",    bench_build_alu },
+    { "branch", bench_build_branch },
+    { "memory", bench_build_memory },
+    { "draw",   bench_build_draw },
+    { "mixed",  bench_build_mixed },
+    { "hires",  bench_build_hires },
+};
+
+typedef struct bench_config {
+    u32         repetitions;
+    u64         instructions;
+    i32         useJit;
+    u32         lanes;
+    const char* romDir;
+} bench_config;
+
+static bench_config config = {
+    .repetitions = 10,
+    .instructions = 50000000,
+    .useJit = 0,
+    .romDir = NULL,
+};
+
+static const char*
+bench_core_name() {
+    if(config.useJit) return "jit";
+    if(config.lanes) {
+        // vector width matters more than anything else here
+        static char name[32];
+        snprintf(name, sizeof(name), "lockstep%u", CHIP8_LANE_WIDTH);
+        return name;
+    }
+#if defined(CHIP8_NO_DECODE_CACHE)
+    return "interp-nocache";
+#elif defined(CHIP8_THREADED_DISPATCH)
+    return "interp-threaded";
+#else
+    return "interp";
+#endif
+}
+
+// Wall time of count instructions over config.lanes machines in lockstep,
+// scaled to exactly count since the last frame overshoots
+static double
+bench_run_lanes(const bench_rom* rom, u64 count) {
+
+    chip8* boot = malloc(sizeof(chip8));
+    assert(boot);
+    chip8_init(boot);
+    chip8_load_rom(boot, rom->data, rom->size);
+    chip8_lanes lanes;
+    if(!chip8_lanes_create(&lanes, boot, config.lanes)) {
+        exit(EXIT_FAILURE);
+    }
+    free(boot);
+
+    u64 start = sched_now();
+    u64 executed = 0;
+    while(executed < count) {
+        u64 ran = chip8_lanes_frame(&lanes, NULL, 1000);
+        if(ran == 0) break;
+        executed += ran;
+    }
+    double seconds = (double)(sched_now() - start) / 1e9;
+    chip8_lanes_dispose(&lanes);
+    return executed >= count ? seconds * (double)count / (double)executed : 0;
+}
+
+// Wall time of one run of count instructions on a fresh machine, 0 if
+// the ROM got stuck before finishing.
+static double
+bench_run_once(const bench_rom* rom, u64 count) {
+
+    if(config.lanes) {
+        return bench_run_lanes(rom, count);
+    }
+
+    chip8* c = malloc(sizeof(chip8));
+    assert(c);
+    chip8_init(c);
+    chip8_load_rom(c, rom->data, rom->size);
+#ifdef CHIP8_JIT_AVAILABLE
+    chip8_jit* jit = config.useJit ? jit_create() : NULL;
+#endif
+
+    u64 start = sched_now();
+    u64 executed = 0;
+    while(executed < count) {
+        u64 left = count - executed;
+        u32 chunk = left > 1000000 ? 1000000 : (u32)left;
+#ifdef CHIP8_JIT_AVAILABLE
+        u32 ran = jit ? jit_run(jit, c, chunk) : chip8_run(c, chunk);
+#else
+        u32 ran = chip8_run(c, chunk);
+#endif
+        executed += ran;
+        if(ran < chunk) break;
+    }
+    double seconds = (double)(sched_now() - start) / 1e9;
+
+#ifdef CHIP8_JIT_AVAILABLE
+    if(jit) jit_dispose(jit);
+#endif
+    free(c);
+    return executed == count ? seconds : 0;
+}
+
+static void
+bench_write_rom(const char* name, const bench_rom* rom) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.ch8", config.romDir, name);
+    FILE* fp = fopen(path, "wb");
+    if(!fp || fwrite(rom->data, rom->size, 1, fp) != 1) {
+        printf("failed to write %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+}
+
+static void
+usage(const char* name) {
+    printf("usage: %s [-r repetitions] [-c instructions] [-x] [-l lanes] [-w rom dir] [class...]\n"
+           "classes:", name);
+    for(u32 i = 0; i < SIZEOF_ARRAY(benchClasses); i++) {
+        printf(" %s", benchClasses[i].name);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char** argv) {
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:c:xl:w:h")) != -1) {
+        switch(opt) {
+            case 'r': config.repetitions = (u32)strtoul(optarg, NULL, 10); break;
+            case 'c': config.instructions = strtoull(optarg, NULL, 10); break;
+            case 'x': config.useJit = 1; break;
+            case 'l': config.lanes = (u32)strtoul(optarg, NULL, 10); break;
+            case 'w': config.romDir = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(config.repetitions == 0 || config.instructions == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(config.useJit && config.lanes) {
+        printf("-x and -l are different cores, pick one\n");
+        return EXIT_FAILURE;
+    }
+#ifndef CHIP8_JIT_AVAILABLE
+    if(config.useJit) {
+        printf("jit not available on this platform, interpreting\n");
+        config.useJit = 0;
+    }
+#endif
+
+    u32 selected[SIZEOF_ARRAY(benchClasses)];
+    u32 selectedCount = 0;
+    if(optind == argc) {
+        for(u32 i = 0; i < SIZEOF_ARRAY(benchClasses); i++) selected[selectedCount++] = i;
+    }
+    for(int a = optind; a < argc; a++) {
+        u32 i = 0;
+        while(i < SIZEOF_ARRAY(benchClasses) && strcmp(argv[a], benchClasses[i].name) != 0) i++;
+        if(i == SIZEOF_ARRAY(benchClasses) || selectedCount == SIZEOF_ARRAY(benchClasses)) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        selected[selectedCount++] = i;
+    }
+
+    printf("# class core repetitions instructions ns_per_instr mips mips_stddev mips_min mips_max\n");
+    for(u32 s = 0; s < selectedCount; s++) {
+        const bench_class* bc = &benchClasses[selected[s]];
+        bench_rom rom = {0};
+        bc->build(&rom);
+        if(config.romDir) {
+            bench_write_rom(bc->name, &rom);
+        }
+
+        // warm caches and the branch predictor, not timed
+        bench_run_once(&rom, config.instructions / 10 + 1);
+
+        double sum = 0, sumSq = 0, best = 0, worst = 0, totalSeconds = 0;
+        i32 stuck = 0;
+        for(u32 r = 0; r < config.repetitions; r++) {
+            double seconds = bench_run_once(&rom, config.instructions);
+            if(seconds == 0) {
+                stuck = 1;
+                break;
+            }
+            double mips = (double)config.instructions / seconds / 1e6;
+            sum += mips;
+            sumSq += mips * mips;
+            if(r == 0 || mips > best) best = mips;
+            if(r == 0 || mips < worst) worst = mips;
+            totalSeconds += seconds;
+        }
+
+        if(stuck) {
+            printf("%s %s stuck\n", bc->name, bench_core_name());
+            fflush(stdout);
+            continue;
+        }
+        double n = (double)config.repetitions;
+        double mean = sum / n;
+        double variance = sumSq / n - mean * mean;
+        printf("%s %s %u %" PRIu64 " %.3f %.2f %.2f %.2f %.2f\n",
+                bc->name, bench_core_name(), config.repetitions, config.instructions,
+                totalSeconds * 1e9 / ((double)config.instructions * n), mean,
+                variance > 0 ? sqrt(variance) : 0.0, worst, best);
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
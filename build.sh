@@ -3,16 +3,57 @@ clear
 BUILD_DIR=./build
 COMPILATION_UNITS=./main.c
 EX_NAME=chip8
+BATCH_UNITS=./batch.c
+BATCH_NAME=chip8-batch
+BENCH_UNITS=./bench.c
+BENCH_NAME=chip8-bench
+TRACEDUMP_UNITS=./tracedump.c
+TRACEDUMP_NAME=chip8-tracedump
+LIB_UNITS=./libchip8.c
+LIB_NAME=libchip8.so
+FUZZ_UNITS=./fuzz.c
+FUZZ_NAME=chip8-fuzz
+AOT_UNITS=./aot.c
+AOT_NAME=chip8-aot
+TEST_UNITS=./test.c
+TEST_NAME=chip8-test
 C_VERSION=-std=c99
+# build time switches go through DEFINES, e.g.
+#   DEFINES=-DCHIP8_THREADED_DISPATCH ./build.sh   computed goto interpreter core
+#   DEFINES=-DCHIP8_NO_DECODE_CACHE ./build.sh     decode every instruction
+#   DEFINES=-DCHIP8_PROFILE ./build.sh            guest profiler, see README
+#   DEFINES=-mavx2 ./build.sh                     AVX2 sprite blits (SSE2 otherwise)
 
 if [ ! -d ./build ]; then
     echo "Creating $BUILD_DIR"
     mkdir $BUILD_DIR
 fi
 
+# the shaders are compiled into chip8, one C string per .sha file
+embed_shader() {
+    echo "static const char $1[] ="
+    sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' -e 's/^/    "/' -e 's/$/\\n"/' "$2"
+    echo "    ;"
+}
+{ embed_shader vertShaderSource vert.sha; embed_shader fragShaderSource frag.sha; } > "$BUILD_DIR"/shaders.h
+
 echo "Building..."
 #
-gcc -g $COMPILATION_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -lm -lSDL2 -lGL -o "$BUILD_DIR"/"$EX_NAME"
+gcc -g $DEFINES -I"$BUILD_DIR" $COMPILATION_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -lm -lSDL2 -lGL -o "$BUILD_DIR"/"$EX_NAME"
 EC=$?
+gcc -g -O2 $DEFINES $BATCH_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -pthread -ldl -o "$BUILD_DIR"/"$BATCH_NAME"
+EC=$(( EC | $? ))
+gcc -g -O2 $DEFINES $BENCH_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -lm -o "$BUILD_DIR"/"$BENCH_NAME"
+EC=$(( EC | $? ))
+gcc -g -O2 -shared -fPIC -fvisibility=hidden $DEFINES $LIB_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -o "$BUILD_DIR"/"$LIB_NAME"
+EC=$(( EC | $? ))
+gcc -g -O2 $DEFINES $FUZZ_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -o "$BUILD_DIR"/"$FUZZ_NAME"
+EC=$(( EC | $? ))
+gcc -g -O2 $DEFINES $AOT_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -o "$BUILD_DIR"/"$AOT_NAME"
+EC=$(( EC | $? ))
+gcc -g -O2 $DEFINES $TEST_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -L"$BUILD_DIR" -lchip8 -Wl,-rpath,'$ORIGIN' -o "$BUILD_DIR"/"$TEST_NAME"
+EC=$(( EC | $? ))
+gcc -g $TRACEDUMP_UNITS $C_VERSION -Wall -Wextra -Wno-missing-braces -Wno-unused-function -o "$BUILD_DIR"/"$TRACEDUMP_NAME"
+EC=$(( EC | $? ))
 
 [ $EC -eq 0 ] && echo "Build succesfull" || echo "Build failed"
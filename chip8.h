@@ -0,0 +1,1276 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include "defs.h"
+#include "fileload.h"
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// 0x000-0x1FF - Chip 8 interpreter (contains font set in emu)
+// 0x000-0x04F - Used for the built in 4x5 pixel font set (0-F)
+// 0x050-0x0EF - SUPER-CHIP 8x10 font (0-F, XO-CHIP has the letters too)
+// 0x200-0xFFFF - Program ROM and work RAM, XO-CHIP sized. Plain CHIP-8
+//                and SUPER-CHIP programs just never look past 0xFFF
+#define CHIP8_WIDTH 64
+#define CHIP8_HEIGHT 32
+#define CHIP8_HIRES_WIDTH 128  // SUPER-CHIP 00FF
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_PLANES 2         // XO-CHIP, 4 colours
+#define CHIP8_MEMORY_SIZE 65536
+#define CHIP8_BIG_FONT 0x50
+
+// sprites that cross a screen edge come back in on the other side,
+// otherwise the part that's off screen is clipped
+#define CHIP8_QUIRK_WRAP 0x1
+
+static const u16 PC_START_LOC = 0x200;
+
+// Why a machine stopped for good, see chip8_raise
+typedef enum chip8_trap {
+    chip8_trap_none,
+    chip8_trap_opcode,
+    chip8_trap_register, // no longer raised, kept so the numbers after it don't move
+    chip8_trap_memory,
+    chip8_trap_key,
+    chip8_trap_font,
+    chip8_trap_stack,
+} chip8_trap;
+
+static const char* chip8TrapNames[] = {
+    "no trap",
+    "unknown opcode",
+    "reqister overflow",
+    "memory overflow",
+    "keypad overflow",
+    "font overflow",
+    "stack overflow",
+};
+
+typedef struct chip8 chip8;
+typedef struct chip8_instr chip8_instr;
+typedef void (*chip8_handler)(chip8* c, const chip8_instr* in);
+
+// One predecoded instruction, handler == NULL means not decoded yet
+struct chip8_instr {
+    chip8_handler handler;
+    u16 opcode;
+    u16 nnn;  // F000 NNNN keeps the second word here
+    u8  x;
+    u8  y;
+    u8  n;
+    u8  nn;
+};
+
+// Whole state of one machine, nothing in the core touches globals
+// so any number of these can run side by side (one per thread if needed).
+// Everything before decoded is the machine proper and is what a save state
+// holds byte for byte (savestate.h), so the order here is the file layout.
+// Fields are sorted by size so there is no hidden padding; bump
+// CHIP8_STATE_VERSION when changing any of them.
+struct chip8 {
+    // Bitplanes, [plane][column][row]. A row is 128 pixels in two u64
+    // columns, bit 63 of column 0 is the leftmost pixel. Keeping columns
+    // contiguous lets draws and scrolls work on many rows per vector op.
+    // In lores only the top left 64x32 (column 0, rows 0-31) is used and
+    // the rest stays clear.
+    u64 canvas[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+    u8 memory[CHIP8_MEMORY_SIZE];
+
+    u32 rngState;    // Cxnn, xorshift32, never 0
+
+    u16 stack[16];
+    u16 IReqister;   //0x0000 to 0xFFFF
+    u16 pc;          //0x0000 to 0xFFFF
+
+    u8 VRegisters[16];
+    u8 keypad[16]; //hex based keypad 0 - F
+    u8 flags[16];  // SUPER-CHIP RPL user flags, Fx75/Fx85
+    u8 audioPattern[16]; // XO-CHIP 1 bit samples played while soundTimer > 0, F002
+
+    u8 delayTimer;
+    u8 soundTimer;
+    u8 stackpointer;
+    u8 keyPressed; // 1 + lowest key that went down this tick, 0 for none, Fx0A
+    u8 quirks;     // CHIP8_QUIRK_*
+    u8 hires;      // 128x64 instead of 64x32, 00FF/00FE
+    u8 planes;     // bitplanes drawn, cleared and scrolled, Fn01
+    u8 pitch;      // audioPattern playback rate, 4000*2^((pitch-64)/48) Hz, Fx3A
+    u8 reserved[8]; // zero, keeps the state a multiple of 8
+
+    // decode cache, one slot per address since jumps can land on odd ones.
+    // Not machine state, can be thrown away at any time
+    chip8_instr decoded[CHIP8_MEMORY_SIZE];
+    // union of all code/memory writes since a translator last looked,
+    // empty when dirtyLo >= dirtyHi
+    u32 dirtyLo;
+    u32 dirtyHi;
+    // canvas changed since the frontend last presented it, only the
+    // frontend clears it so it isn't part of the state
+    u8 draw;
+    u8 trap;           // chip8_trap that stopped the machine, none while it runs
+    chip8_trace trace; // diagnostics, see trace.h
+#ifdef CHIP8_PROFILE
+    struct chip8_profile* profile; // NULL when not profiling this machine
+#endif
+#ifdef CHIP8_COVERAGE
+    u8* coverage; // per address hit counts, saturating, NULL for none (fuzz.c)
+#endif
+};
+
+static const unsigned char chip8Fontset[] =
+{
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+static const unsigned char chip8BigFontset[] =
+{
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+static void
+chip8_init(chip8* c) {
+
+    memset(c, 0, sizeof(*c));
+    c->pc = PC_START_LOC;
+    c->rngState = 1;
+    c->planes = 1;
+    // a 500Hz square wave until a program loads its own pattern
+    memset(c->audioPattern, 0xF0, sizeof(c->audioPattern));
+    c->pitch = 64;
+
+    for(int i = 0; i < (int)SIZEOF_ARRAY(chip8Fontset); ++i)
+        c->memory[/*0x050 +*/  i] = chip8Fontset[i];
+    memcpy(c->memory + CHIP8_BIG_FONT, chip8BigFontset, sizeof(chip8BigFontset));
+}
+
+// Cxnn draws from a per machine generator so runs can be reproduced
+// and saved, seed 0 is remapped since xorshift would get stuck on it
+static void
+chip8_seed(chip8* c, u32 seed) {
+    c->rngState = seed ? seed : 0x9E3779B9;
+}
+
+static inline u32
+chip8_random(chip8* c) {
+    u32 x = c->rngState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c->rngState = x;
+    return x;
+}
+
+// keypad as a bitmask, bit n is key n
+static u16
+chip8_get_keys(const chip8* c) {
+    u16 keys = 0;
+    for(u32 i = 0; i < 16; i++) {
+        keys |= (u16)(c->keypad[i] != 0) << i;
+    }
+    return keys;
+}
+
+// Sets the whole keypad at once, once per tick. A key that went down since
+// the last call is the key press Fx0A waits for, it stays there for the
+// rest of the tick unless an Fx0A takes it.
+static void
+chip8_set_keys(chip8* c, u16 keys) {
+    u16 pressed = keys & ~chip8_get_keys(c);
+    for(u32 i = 0; i < 16; i++) {
+        c->keypad[i] = (keys >> i) & 1;
+    }
+    c->keyPressed = 0;
+    for(u32 i = 0; i < 16; i++) {
+        if(pressed & (1 << i)) {
+            c->keyPressed = (u8)(i + 1);
+            break;
+        }
+    }
+}
+
+// Waiting in Fx0A with the timers run out, ticks can't change anything
+// until a key goes down so a frontend may as well sleep on its input.
+static i32
+chip8_key_blocked(const chip8* c) {
+    return c->memory[c->pc] >> 4 == 0xF && c->memory[(u16)(c->pc + 1)] == 0x0A &&
+        c->keyPressed == 0 && c->delayTimer == 0 && c->soundTimer == 0;
+}
+
+// where a fatal trap leaves the trace, frontends can point it elsewhere
+static const char* chip8TracePath = "chip8.trace";
+
+static inline void
+chip8_trace_instr(chip8* c, const chip8_instr* in, chip8_trace_event event) {
+    chip8_trace_record(&c->trace, event, c->pc, in->opcode, c->IReqister,
+            c->stackpointer, c->VRegisters);
+}
+
+_Static_assert(chip8_trace_trap_stack - chip8_trace_trap_opcode == chip8_trap_stack - chip8_trap_opcode,
+        "trap kinds and their trace events out of order");
+
+// Unrecoverable guest error. The instruction is left undone with pc on
+// it, so every core stops there as on a stall, and the machine doesn't run
+// again until it's reloaded. What to do about it is up to the frontend.
+static void
+chip8_raise(chip8* c, const chip8_instr* in, chip8_trap trap) {
+    chip8_trace_instr(c, in, chip8_trace_trap_opcode + (trap - chip8_trap_opcode));
+    c->trap = (u8)trap;
+}
+
+// Prints what stopped a trapped machine and dumps its trace
+static void
+chip8_trap_report(chip8* c) {
+    u16 opcode = c->memory[c->pc] << 8 | c->memory[(u16)(c->pc + 1)];
+    chip8_trace_dump(&c->trace, chip8TracePath);
+    printf("%s at %03X (opcode %04X), trace written to %s\n",
+            chip8TrapNames[c->trap], c->pc, opcode, chip8TracePath);
+}
+
+// dump on request, the marker shows where the machine was when asked
+static i32
+chip8_trace_request(chip8* c, const char* path) {
+    chip8_trace_record(&c->trace, chip8_trace_marker, c->pc, 0, c->IReqister,
+            c->stackpointer, c->VRegisters);
+    return chip8_trace_dump(&c->trace, path);
+}
+
+// checks for the handlers, on failure the handler returns without doing anything
+#define CHIP8_CHECK(C, IN, COND, TRAP) do{if(COND) { chip8_raise(C, IN, TRAP); return; }} while(0)
+#define MEMADDR_VALIDATION(C, IN, R) CHIP8_CHECK(C, IN, R > CHIP8_MEMORY_SIZE - 1, chip8_trap_memory)
+#define KEY_VALIDATION(C, IN, R) CHIP8_CHECK(C, IN, R > 0xF, chip8_trap_key)
+#define FONT_VALIDATION(C, IN, R) CHIP8_CHECK(C, IN, R > 0xF, chip8_trap_font)
+#define STACK_VALIDATION(C, IN, R) CHIP8_CHECK(C, IN, R > 15, chip8_trap_stack)
+
+// Drop cached decodes that read any byte of [addr, addr + len), the
+// instructions up to addr - 3 can read addr (F000 NNNN is 4 bytes)
+static inline void
+chip8_invalidate(chip8* c, u32 addr, u32 len) {
+    u32 start = addr > 3 ? addr - 3 : 0;
+    u32 end = addr + len;
+    if(end > CHIP8_MEMORY_SIZE) end = CHIP8_MEMORY_SIZE;
+    for(u32 i = start; i < end; i++) {
+        c->decoded[i].handler = NULL;
+    }
+    if(c->dirtyLo >= c->dirtyHi) {
+        c->dirtyLo = start;
+        c->dirtyHi = end;
+    } else {
+        if(start < c->dirtyLo) c->dirtyLo = start;
+        if(end > c->dirtyHi) c->dirtyHi = end;
+    }
+}
+
+// returns 0 if rom does not fit into program memory
+static i32
+chip8_load_rom(chip8* c, const u8* data, size_t size) {
+
+    if(size >= (SIZEOF_ARRAY(c->memory) - (int)PC_START_LOC)) {
+        return 0;
+    }
+    memcpy(c->memory + PC_START_LOC, data, size);
+    chip8_invalidate(c, PC_START_LOC, size);
+    return 1;
+}
+
+// Handlers for every instruction, the decoder picks one per address
+// and caches it together with the already extracted operands.
+// Operand validation that only depends on the opcode is done once by the
+// decoder (bad opcodes get chip8_op_invalid), only state dependent checks
+// (stack, I range, key values) are left in the handlers.
+
+static void
+chip8_op_invalid(chip8* c, const chip8_instr* in) {
+    chip8_raise(c, in, chip8_trap_opcode);
+}
+
+static void
+chip8_op_00EE(chip8* c, const chip8_instr* in) { // return from subroutine
+    STACK_VALIDATION(c, in, (u8)(c->stackpointer - 1));
+    c->stackpointer -= 1;
+    //printf("stackptr %d stack %d \n", c->stackpointer, c->stack[c->stackpointer]);
+    c->pc = c->stack[c->stackpointer];
+    c->pc += 2;
+}
+
+static void
+chip8_op_00E0(chip8* c, const chip8_instr* in) { // display clear, the selected planes
+    (void)in;
+    for(u32 p = 0; p < CHIP8_PLANES; p++) {
+        if(c->planes & (1 << p)) memset(c->canvas[p], 0, sizeof(c->canvas[p]));
+    }
+    c->draw = 1;
+    c->pc += 2;
+}
+
+static void
+chip8_op_1NNN(chip8* c, const chip8_instr* in) { // Jumps to address NNN
+    c->pc = in->nnn;
+}
+
+static void
+chip8_op_2NNN(chip8* c, const chip8_instr* in) { // Calls subroutine at NNN
+    STACK_VALIDATION(c, in, c->stackpointer + 1);
+    c->stack[c->stackpointer] = c->pc;
+    c->stackpointer += 1;
+    c->pc = in->nnn;
+}
+
+// Skips the instruction after the one at pc, F000 NNNN takes 4 bytes
+static inline void
+chip8_skip_next(chip8* c) {
+    u16 next = c->pc + 2;
+    c->pc += c->memory[next] == 0xF0 && c->memory[(u16)(next + 1)] == 0x00 ? 4 : 2;
+}
+
+static void
+chip8_op_3XNN(chip8* c, const chip8_instr* in) { // Skips the next instruction if VX equals NN.
+    if(c->VRegisters[in->x] == in->nn) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_4XNN(chip8* c, const chip8_instr* in) { // Skips the next instruction if VX does not equals NN.
+    if(c->VRegisters[in->x] != in->nn) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_5XY0(chip8* c, const chip8_instr* in) { // Skips the next instruction if VX equals VY.
+    if(c->VRegisters[in->x] == c->VRegisters[in->y]) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_5XY2(chip8* c, const chip8_instr* in) { // Stores VX to VY (either order) in memory starting at I (XO-CHIP)
+    u8 count = (u8)(in->x > in->y ? in->x - in->y : in->y - in->x);
+    i32 step = in->x > in->y ? -1 : 1;
+    MEMADDR_VALIDATION(c, in, c->IReqister + count);
+    for(u8 i = 0; i <= count; i++) {
+        c->memory[c->IReqister + i] = c->VRegisters[in->x + step * i];
+    }
+    chip8_invalidate(c, c->IReqister, count + 1);
+    c->pc += 2;
+}
+
+static void
+chip8_op_5XY3(chip8* c, const chip8_instr* in) { // Loads VX to VY (either order) from memory starting at I (XO-CHIP)
+    u8 count = (u8)(in->x > in->y ? in->x - in->y : in->y - in->x);
+    i32 step = in->x > in->y ? -1 : 1;
+    MEMADDR_VALIDATION(c, in, c->IReqister + count);
+    for(u8 i = 0; i <= count; i++) {
+        c->VRegisters[in->x + step * i] = c->memory[c->IReqister + i];
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_6XNN(chip8* c, const chip8_instr* in) { //Sets VX to NN.
+    c->VRegisters[in->x] = in->nn;
+    c->pc += 2;
+}
+
+static void
+chip8_op_7XNN(chip8* c, const chip8_instr* in) { // Adds NN to VX. (Carry flag is not changed)
+    c->VRegisters[in->x] += in->nn;
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY0(chip8* c, const chip8_instr* in) { // Sets VX to the value of VY.
+    c->VRegisters[in->x] = c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY1(chip8* c, const chip8_instr* in) { // Bitwise OR operation
+    c->VRegisters[in->x] = c->VRegisters[in->x] | c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY2(chip8* c, const chip8_instr* in) { // Bitwise AND operation
+    c->VRegisters[in->x] = c->VRegisters[in->x] & c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY3(chip8* c, const chip8_instr* in) { // Sets VX to VX xor VY.
+    c->VRegisters[in->x] ^= c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY4(chip8* c, const chip8_instr* in) { // Adds VY to VX. VF is set to 1 when there's a carry,
+    // and to 0 when there isn't.
+    c->VRegisters[0xF] = 0;
+    if(c->VRegisters[in->y] > (0xFF - c->VRegisters[in->x])) {
+        // Overflow
+        c->VRegisters[0xF] = 1;
+    }
+    c->VRegisters[in->x] += c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY5(chip8* c, const chip8_instr* in) { // VY is subtracted from VX. VF is set to 0 when there's a borrow,
+    // and 1 when there isn't.
+    c->VRegisters[0xF] = 1;
+    if(c->VRegisters[in->x] < c->VRegisters[in->y]) {
+        // Underflow
+        c->VRegisters[0xF] = 0;
+    }
+    c->VRegisters[in->x] -= c->VRegisters[in->y];
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY6(chip8* c, const chip8_instr* in) { // Stores the least significant bit of VX in VF
+    // and then shifts VX to the right by 1
+    u8 lsb = c->VRegisters[in->x] & 0x01;
+    c->VRegisters[0xF] = lsb;
+    c->VRegisters[in->x] >>= 1;
+    chip8_trace_instr(c, in, chip8_trace_shift_right);
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XY7(chip8* c, const chip8_instr* in) { // Sets VX to VY minus VX. VF is set to 0 when there's a borrow,
+    // and 1 when there isn't
+    // v[0xF] = *vxptr < *vyptr ? 1 : 0; // Reverse of the other SUB TODO
+    c->VRegisters[0xF] = 1;
+    if((int)c->VRegisters[in->y] < (int)c->VRegisters[in->x]) {
+        // Underflow;
+        c->VRegisters[0xF] = 0;
+    }
+    c->VRegisters[in->x] = c->VRegisters[in->y] - c->VRegisters[in->x];
+    chip8_trace_instr(c, in, chip8_trace_sub_reverse);
+    c->pc += 2;
+}
+
+static void
+chip8_op_8XYE(chip8* c, const chip8_instr* in) { // Stores the most significant bit of VX in VF
+    // and then shifts VX to the left by 1
+    u8 msb = c->VRegisters[in->x] >> 7;
+    c->VRegisters[0xF] = msb;
+    c->VRegisters[in->x] <<= 1;
+    c->pc += 2;
+}
+
+static void
+chip8_op_9XY0(chip8* c, const chip8_instr* in) { //Skips the next instruction if VX doesn't equal VY
+    if(c->VRegisters[in->x] != c->VRegisters[in->y]) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_ANNN(chip8* c, const chip8_instr* in) { // Sets I to the address NNN
+    c->IReqister = in->nnn;
+    c->pc += 2;
+}
+
+static void
+chip8_op_BNNN(chip8* c, const chip8_instr* in) { // Jumps to the address NNN plus V0
+    // at most 0x10FE, always inside memory
+    c->pc = in->nnn + (u16)c->VRegisters[0];
+}
+
+static void
+chip8_op_CXNN(chip8* c, const chip8_instr* in) { // Sets VX to the result of a bitwise
+    // and operation on a random number (Typically: 0 to 255) and NN.
+    c->VRegisters[in->x] = (u8)chip8_random(c) & in->nn;
+    c->pc += 2;
+}
+
+static inline u64
+chip8_sprite_mask(u8 row, u32 x, i32 wrap) {
+    u64 bits = (u64)row << 56;
+    if(!wrap || x == 0) return bits >> x;
+    return (bits >> x) | (bits << (64 - x));
+}
+
+// XORs count sprite rows into consecutive canvas rows starting at x,
+// returns 1 if any lit pixel got turned off
+static inline i32
+chip8_blit(u64* rows, const u8* sprite, u32 count, u32 x, i32 wrap) {
+
+    u32 i = 0;
+    u64 hit = 0;
+#if defined(__AVX2__)
+    {
+        const __m128i shr = _mm_cvtsi32_si128((int)x);
+        const __m128i shl = _mm_cvtsi32_si128(wrap ? 64 - (int)x : 64); // 64 shifts to zero
+        __m256i hits = _mm256_setzero_si256();
+        for(; i + 4 <= count; i += 4) {
+            u32 packed;
+            memcpy(&packed, sprite + i, 4);
+            __m256i bits = _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128((int)packed)), 56);
+            __m256i mask = _mm256_or_si256(_mm256_srl_epi64(bits, shr), _mm256_sll_epi64(bits, shl));
+            __m256i dst = _mm256_loadu_si256((const __m256i*)(rows + i));
+            hits = _mm256_or_si256(hits, _mm256_and_si256(dst, mask));
+            _mm256_storeu_si256((__m256i*)(rows + i), _mm256_xor_si256(dst, mask));
+        }
+        hit |= !_mm256_testz_si256(hits, hits);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i shr = _mm_cvtsi32_si128((int)x);
+        const __m128i shl = _mm_cvtsi32_si128(wrap ? 64 - (int)x : 64);
+        __m128i hits = _mm_setzero_si128();
+        for(; i + 2 <= count; i += 2) {
+            __m128i bits = _mm_set_epi64x((i64)((u64)sprite[i + 1] << 56), (i64)((u64)sprite[i] << 56));
+            __m128i mask = _mm_or_si128(_mm_srl_epi64(bits, shr), _mm_sll_epi64(bits, shl));
+            __m128i dst = _mm_loadu_si128((const __m128i*)(rows + i));
+            hits = _mm_or_si128(hits, _mm_and_si128(dst, mask));
+            _mm_storeu_si128((__m128i*)(rows + i), _mm_xor_si128(dst, mask));
+        }
+        hit |= _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) != 0xFFFF;
+    }
+#endif
+    for(; i < count; i++) {
+        u64 mask = chip8_sprite_mask(sprite[i], x, wrap);
+        hit |= rows[i] & mask;
+        rows[i] ^= mask;
+    }
+    return hit != 0;
+}
+
+// XORs precomputed masks into count consecutive rows of one column,
+// returns 1 if any lit pixel got turned off
+static inline i32
+chip8_xor_rows(u64* rows, const u64* masks, u32 count) {
+
+    u32 i = 0;
+    u64 hit = 0;
+#if defined(__AVX2__)
+    {
+        __m256i hits = _mm256_setzero_si256();
+        for(; i + 4 <= count; i += 4) {
+            __m256i mask = _mm256_loadu_si256((const __m256i*)(masks + i));
+            __m256i dst = _mm256_loadu_si256((const __m256i*)(rows + i));
+            hits = _mm256_or_si256(hits, _mm256_and_si256(dst, mask));
+            _mm256_storeu_si256((__m256i*)(rows + i), _mm256_xor_si256(dst, mask));
+        }
+        hit |= !_mm256_testz_si256(hits, hits);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i hits = _mm_setzero_si128();
+        for(; i + 2 <= count; i += 2) {
+            __m128i mask = _mm_loadu_si128((const __m128i*)(masks + i));
+            __m128i dst = _mm_loadu_si128((const __m128i*)(rows + i));
+            hits = _mm_or_si128(hits, _mm_and_si128(dst, mask));
+            _mm_storeu_si128((__m128i*)(rows + i), _mm_xor_si128(dst, mask));
+        }
+        hit |= _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) != 0xFFFF;
+    }
+#endif
+    for(; i < count; i++) {
+        hit |= rows[i] & masks[i];
+        rows[i] ^= masks[i];
+    }
+    return hit != 0;
+}
+
+// Shifts count rows of a 64 (right == NULL) or 128 pixel wide plane
+// sideways by 0 < shift < 64 pixels, positive is to the right.
+// Pixels shifted out are lost, new ones come in clear.
+static inline void
+chip8_shift_rows(u64* left, u64* right, u32 count, i32 shift) {
+
+    u32 by = (u32)(shift < 0 ? -shift : shift);
+    u32 i = 0;
+#if defined(__AVX2__)
+    {
+        const __m128i near = _mm_cvtsi32_si128((int)by);
+        const __m128i far = _mm_cvtsi32_si128(64 - (int)by);
+        for(; i + 4 <= count; i += 4) {
+            __m256i l = _mm256_loadu_si256((const __m256i*)(left + i));
+            __m256i r = right ? _mm256_loadu_si256((const __m256i*)(right + i)) : _mm256_setzero_si256();
+            __m256i nl, nr;
+            if(shift > 0) {
+                nl = _mm256_srl_epi64(l, near);
+                nr = _mm256_or_si256(_mm256_srl_epi64(r, near), _mm256_sll_epi64(l, far));
+            } else {
+                nl = _mm256_or_si256(_mm256_sll_epi64(l, near), _mm256_srl_epi64(r, far));
+                nr = _mm256_sll_epi64(r, near);
+            }
+            _mm256_storeu_si256((__m256i*)(left + i), nl);
+            if(right) _mm256_storeu_si256((__m256i*)(right + i), nr);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i near = _mm_cvtsi32_si128((int)by);
+        const __m128i far = _mm_cvtsi32_si128(64 - (int)by);
+        for(; i + 2 <= count; i += 2) {
+            __m128i l = _mm_loadu_si128((const __m128i*)(left + i));
+            __m128i r = right ? _mm_loadu_si128((const __m128i*)(right + i)) : _mm_setzero_si128();
+            __m128i nl, nr;
+            if(shift > 0) {
+                nl = _mm_srl_epi64(l, near);
+                nr = _mm_or_si128(_mm_srl_epi64(r, near), _mm_sll_epi64(l, far));
+            } else {
+                nl = _mm_or_si128(_mm_sll_epi64(l, near), _mm_srl_epi64(r, far));
+                nr = _mm_sll_epi64(r, near);
+            }
+            _mm_storeu_si128((__m128i*)(left + i), nl);
+            if(right) _mm_storeu_si128((__m128i*)(right + i), nr);
+        }
+    }
+#endif
+    for(; i < count; i++) {
+        u64 l = left[i], r = right ? right[i] : 0;
+        if(shift > 0) {
+            left[i] = l >> by;
+            r = (r >> by) | (l << (64 - by));
+        } else {
+            left[i] = (l << by) | (r >> (64 - by));
+            r <<= by;
+        }
+        if(right) right[i] = r;
+    }
+}
+
+// Masks of one sprite row of w pixels at x, for the two columns of a
+// row. Pixels past the right edge of the width wide screen are clipped,
+// or come back in on the left with wrap.
+static inline void
+chip8_sprite_masks(u32 bits, u32 w, u32 x, u32 width, i32 wrap, u64* left, u64* right) {
+
+    u64 row = (u64)bits << (64 - w);
+    u64 l, r;
+    if(x == 0)      { l = row; r = 0; }
+    else if(x < 64) { l = row >> x; r = row << (64 - x); }
+    else            { l = 0; r = row >> (x - 64); }
+
+    if(width == CHIP8_WIDTH) {
+        // lores has no right column, what went there is the overflow
+        if(wrap) l |= r;
+        r = 0;
+    } else if(wrap && x + w > CHIP8_HIRES_WIDTH) {
+        l |= row << (CHIP8_HIRES_WIDTH - x);
+    }
+    *left = l;
+    *right = r;
+}
+
+static void
+chip8_op_DXYN(chip8* c, const chip8_instr* in) {
+    // Draws a sprite at coordinate (VX, VY)
+    // that has a width of 8 pixels and a height of N pixels.
+    // Each row of 8 pixels is read as bit-coded starting from memory location I;
+    // I value doesn’t change after the execution of this instruction.
+    // As described above,
+    // VF is set to 1 if any screen pixels are flipped from set to unset when the sprite is drawn,
+    // and to 0 if that doesn’t happen
+    // The start position always wraps, CHIP8_QUIRK_WRAP decides what happens
+    // to the part of the sprite that goes past the edge.
+    // N == 0 draws a 16x16 sprite (SUPER-CHIP). Every selected plane gets
+    // its own sprite, one after the other in memory (XO-CHIP).
+    c->draw = 1;
+    u32 width = c->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    u32 height = c->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    u32 startX = c->VRegisters[in->x] % width;
+    u32 startY = c->VRegisters[in->y] % height;
+    i32 wrap = c->quirks & CHIP8_QUIRK_WRAP;
+    u32 rows = in->n ? in->n : 16;
+    u32 spriteWidth = in->n ? 8 : 16;
+    u32 spriteBytes = rows * spriteWidth / 8;
+
+    u32 visible = rows;
+    if(startY + visible > height) visible = height - startY;
+
+    if(spriteWidth == 8 && width == CHIP8_WIDTH && c->planes == 1) {
+        // plain CHIP-8, by far the most common: one plane, one column
+        // and byte wide rows straight into the blitter
+        u8 sprite[16];
+        for(u32 i = 0; i < rows; i++) {
+            sprite[i] = c->memory[(u16)(c->IReqister + i)];
+        }
+        i32 collision = chip8_blit(c->canvas[0][0] + startY, sprite, visible, startX, wrap);
+        if(wrap && visible < rows) {
+            collision |= chip8_blit(c->canvas[0][0], sprite + visible, rows - visible, startX, wrap);
+        }
+        c->VRegisters[0xF] = (u8)collision;
+        c->pc += 2;
+        return;
+    }
+
+    i32 collision = 0;
+    u16 addr = c->IReqister;
+    for(u32 p = 0; p < CHIP8_PLANES; p++) {
+        if(!(c->planes & (1 << p))) continue;
+
+        u8 sprite[32];
+        for(u32 i = 0; i < spriteBytes; i++) {
+            sprite[i] = c->memory[(u16)(addr + i)];
+        }
+        addr += spriteBytes;
+
+        u64 (*plane)[CHIP8_HIRES_HEIGHT] = c->canvas[p];
+        u64 left[16], right[16];
+        for(u32 i = 0; i < rows; i++) {
+            u32 bits = spriteWidth == 8 ? sprite[i] : (u32)sprite[i * 2] << 8 | sprite[i * 2 + 1];
+            chip8_sprite_masks(bits, spriteWidth, startX, width, wrap, &left[i], &right[i]);
+        }
+        collision |= chip8_xor_rows(plane[0] + startY, left, visible);
+        if(width == CHIP8_HIRES_WIDTH) collision |= chip8_xor_rows(plane[1] + startY, right, visible);
+        if(wrap && visible < rows) {
+            collision |= chip8_xor_rows(plane[0], left + visible, rows - visible);
+            if(width == CHIP8_HIRES_WIDTH) collision |= chip8_xor_rows(plane[1], right + visible, rows - visible);
+        }
+    }
+    c->VRegisters[0xF] = (u8)collision;
+    c->pc += 2;
+}
+
+// Scrolls the selected planes, dy rows down (negative is up) or dx
+// pixels right (negative is left), in pixels of the current mode
+static void
+chip8_scroll(chip8* c, i32 dx, i32 dy) {
+
+    u32 height = c->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    u32 columns = c->hires ? 2 : 1;
+    for(u32 p = 0; p < CHIP8_PLANES; p++) {
+        if(!(c->planes & (1 << p))) continue;
+        u64 (*plane)[CHIP8_HIRES_HEIGHT] = c->canvas[p];
+        if(dx) {
+            chip8_shift_rows(plane[0], columns == 2 ? plane[1] : NULL, height, dx);
+        }
+        u32 by = (u32)(dy < 0 ? -dy : dy);
+        if(by > height) by = height;
+        for(u32 col = 0; by && col < columns; col++) {
+            if(dy > 0) {
+                memmove(plane[col] + by, plane[col], (height - by) * sizeof(u64));
+                memset(plane[col], 0, by * sizeof(u64));
+            } else {
+                memmove(plane[col], plane[col] + by, (height - by) * sizeof(u64));
+                memset(plane[col] + height - by, 0, by * sizeof(u64));
+            }
+        }
+    }
+    c->draw = 1;
+}
+
+static void
+chip8_op_00CN(chip8* c, const chip8_instr* in) { // Scrolls the display down by N rows (SUPER-CHIP)
+    chip8_scroll(c, 0, in->n);
+    c->pc += 2;
+}
+
+static void
+chip8_op_00DN(chip8* c, const chip8_instr* in) { // Scrolls the display up by N rows (XO-CHIP)
+    chip8_scroll(c, 0, -(i32)in->n);
+    c->pc += 2;
+}
+
+static void
+chip8_op_00FB(chip8* c, const chip8_instr* in) { // Scrolls the display right by 4 pixels
+    (void)in;
+    chip8_scroll(c, 4, 0);
+    c->pc += 2;
+}
+
+static void
+chip8_op_00FC(chip8* c, const chip8_instr* in) { // Scrolls the display left by 4 pixels
+    (void)in;
+    chip8_scroll(c, -4, 0);
+    c->pc += 2;
+}
+
+static void
+chip8_op_00FD(chip8* c, const chip8_instr* in) { // Exits the interpreter, the machine stalls here
+    (void)c;
+    (void)in;
+}
+
+// switching resolution clears every plane, lores keeps the rest clear
+static void
+chip8_set_hires(chip8* c, u8 hires) {
+    memset(c->canvas, 0, sizeof(c->canvas));
+    c->hires = hires;
+    c->draw = 1;
+}
+
+static void
+chip8_op_00FE(chip8* c, const chip8_instr* in) { // Lores, 64x32
+    (void)in;
+    chip8_set_hires(c, 0);
+    c->pc += 2;
+}
+
+static void
+chip8_op_00FF(chip8* c, const chip8_instr* in) { // Hires, 128x64
+    (void)in;
+    chip8_set_hires(c, 1);
+    c->pc += 2;
+}
+
+static void
+chip8_op_EX9E(chip8* c, const chip8_instr* in) { // Skips the next instruction if the key stored in VX is pressed
+    u8 key = c->VRegisters[in->x];
+    KEY_VALIDATION(c, in, key);
+    if(c->keypad[key]) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_EXA1(chip8* c, const chip8_instr* in) { // Skips the next instruction if the key stored in VX isn't pressed
+    u8 key = c->VRegisters[in->x];
+    KEY_VALIDATION(c, in, key);
+    if(!c->keypad[key]) {
+        chip8_skip_next(c);
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_F000(chip8* c, const chip8_instr* in) { // Sets I to the 16 bit address in the next word (XO-CHIP)
+    c->IReqister = in->nnn;
+    c->pc += 4;
+}
+
+static void
+chip8_op_FN01(chip8* c, const chip8_instr* in) { // Selects the bitplanes N for drawing, clearing and scrolling (XO-CHIP)
+    c->planes = in->x & 0x3;
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX07(chip8* c, const chip8_instr* in) { // Sets VX to the value of the delay timer
+    c->VRegisters[in->x] = c->delayTimer;
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX0A(chip8* c, const chip8_instr* in) { // A key press is awaited, and then stored in VX.
+    // (Blocking Operation. All instruction halted until next key event)
+    if(c->keyPressed == 0) {
+        chip8_trace_instr(c, in, chip8_trace_key_wait);
+        return;
+    }
+    c->VRegisters[in->x] = c->keyPressed - 1;
+    c->keyPressed = 0;
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX15(chip8* c, const chip8_instr* in) { // Sets the delay timer to VX.
+    c->delayTimer = c->VRegisters[in->x];
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX18(chip8* c, const chip8_instr* in) { // Sets the sound timer to VX
+    c->soundTimer = c->VRegisters[in->x];
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX1E(chip8* c, const chip8_instr* in) { // Adds VX to I. VF is set to 1
+    // when there is a range overflow (I+VX>0xFFF), and to 0 when there isn't.
+    c->VRegisters[0xF] = 0;
+    c->IReqister += c->VRegisters[in->x];
+    if(c->IReqister > 0xFFF) { //12 bit wide in chip8
+        //IReqister -= 0xFFF + 1; //(-1 rolls to 0)
+        c->VRegisters[0xF] = 1;
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX29(chip8* c, const chip8_instr* in) {
+    // Sets I to the location of the sprite for the character in VX.
+    // Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+    u8 font = c->VRegisters[in->x];
+    chip8_trace_instr(c, in, chip8_trace_font);
+    FONT_VALIDATION(c, in, font);
+    c->IReqister = /*0x050 +*/  font * 5;
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX30(chip8* c, const chip8_instr* in) {
+    // Sets I to the 8x10 sprite for the digit in VX (SUPER-CHIP, XO-CHIP has A-F too)
+    u8 font = c->VRegisters[in->x];
+    FONT_VALIDATION(c, in, font);
+    c->IReqister = CHIP8_BIG_FONT + font * 10;
+    c->pc += 2;
+}
+
+static void
+chip8_op_F002(chip8* c, const chip8_instr* in) { // Loads the 16 byte audio pattern from I (XO-CHIP)
+    MEMADDR_VALIDATION(c, in, c->IReqister + 15);
+    memcpy(c->audioPattern, c->memory + c->IReqister, sizeof(c->audioPattern));
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX3A(chip8* c, const chip8_instr* in) { // Sets the audio pattern playback pitch to VX (XO-CHIP)
+    c->pitch = c->VRegisters[in->x];
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX33(chip8* c, const chip8_instr* in) { //  Stores the binary-coded decimal representation of VX,
+    // with the most significant of three digits at the address in I,
+    // the middle digit at I plus 1, and the least significant digit at I plus 2.
+    // (In other words, take the decimal representation of VX,
+    // place the hundreds digit in memory at location in I,
+    // the tens digit at location I+1, and the ones digit at location I+2.)
+    MEMADDR_VALIDATION(c, in, c->IReqister + 2);
+    c->memory[c->IReqister]     = c->VRegisters[in->x] / 100;
+    c->memory[c->IReqister + 1] = (c->VRegisters[in->x] / 10) % 10;
+    c->memory[c->IReqister + 2] = c->VRegisters[in->x] % 10;
+    chip8_invalidate(c, c->IReqister, 3);
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX55(chip8* c, const chip8_instr* in) { // Stores V0 to VX (including VX) in memory starting at address I.
+    // The offset from I is increased by 1 for each value written,
+    // but I itself is left unmodified
+    MEMADDR_VALIDATION(c, in, c->IReqister + in->x);
+    chip8_trace_instr(c, in, chip8_trace_store);
+    for(u8 i = 0; i <= in->x; i++) {
+        c->memory[c->IReqister + i] = c->VRegisters[i];
+    }
+    chip8_invalidate(c, c->IReqister, in->x + 1);
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX65(chip8* c, const chip8_instr* in) { // Fills V0 to VX (including VX) with values from memory
+    // starting at address I.
+    // The offset from I is increased by 1 for each value written,
+    // but I itself is left unmodified.[d]
+    MEMADDR_VALIDATION(c, in, c->IReqister + in->x);
+    for(u8 i = 0; i <= in->x; i++) {
+        c->VRegisters[i] =  c->memory[c->IReqister + i];
+    }
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX75(chip8* c, const chip8_instr* in) { // Stores V0 to VX in the RPL user flags (SUPER-CHIP)
+    memcpy(c->flags, c->VRegisters, in->x + 1);
+    c->pc += 2;
+}
+
+static void
+chip8_op_FX85(chip8* c, const chip8_instr* in) { // Fills V0 to VX from the RPL user flags (SUPER-CHIP)
+    memcpy(c->VRegisters, c->flags, in->x + 1);
+    c->pc += 2;
+}
+
+static chip8_handler
+chip8_decode_handler(u16 opcode) {
+
+    switch(opcode & 0xF000) {
+        case 0x0000:
+            if(opcode & 0x0F00) return chip8_op_invalid;
+            switch(opcode & 0x00F0) {
+                case 0x0C0: return chip8_op_00CN;
+                case 0x0D0: return chip8_op_00DN;
+            }
+            switch(opcode & 0x00FF) {
+                case 0x0EE: return chip8_op_00EE;
+                case 0x0E0: return chip8_op_00E0;
+                case 0x0FB: return chip8_op_00FB;
+                case 0x0FC: return chip8_op_00FC;
+                case 0x0FD: return chip8_op_00FD;
+                case 0x0FE: return chip8_op_00FE;
+                case 0x0FF: return chip8_op_00FF;
+                default:    return chip8_op_invalid;
+            }
+        case 0x1000: return chip8_op_1NNN;
+        case 0x2000: return chip8_op_2NNN;
+        case 0x3000: return chip8_op_3XNN;
+        case 0x4000: return chip8_op_4XNN;
+        case 0x5000:
+            switch(opcode & 0x000F) {
+                case 0x0: return chip8_op_5XY0;
+                case 0x2: return chip8_op_5XY2;
+                case 0x3: return chip8_op_5XY3;
+                default:  return chip8_op_invalid;
+            }
+        case 0x6000: return chip8_op_6XNN;
+        case 0x7000: return chip8_op_7XNN;
+        case 0x8000:
+            switch(opcode & 0x000F) {
+                case 0x0: return chip8_op_8XY0;
+                case 0x1: return chip8_op_8XY1;
+                case 0x2: return chip8_op_8XY2;
+                case 0x3: return chip8_op_8XY3;
+                case 0x4: return chip8_op_8XY4;
+                case 0x5: return chip8_op_8XY5;
+                case 0x6: return chip8_op_8XY6;
+                case 0x7: return chip8_op_8XY7;
+                case 0xE: return chip8_op_8XYE;
+                default:  return chip8_op_invalid;
+            }
+        case 0x9000: return chip8_op_9XY0;
+        case 0xA000: return chip8_op_ANNN;
+        case 0xB000: return chip8_op_BNNN;
+        case 0xC000: return chip8_op_CXNN;
+        case 0xD000: return chip8_op_DXYN;
+        case 0xE000:
+            switch(opcode & 0x00FF) {
+                case 0x09E: return chip8_op_EX9E;
+                case 0x0A1: return chip8_op_EXA1;
+                default:    return chip8_op_invalid;
+            }
+        case 0xF000:
+            if(opcode == 0xF000) return chip8_op_F000;
+            switch(opcode & 0x00FF) {
+                case 0x0001: return (opcode & 0x0C00) ? chip8_op_invalid : chip8_op_FN01;
+                case 0x0002: return (opcode & 0x0F00) ? chip8_op_invalid : chip8_op_F002;
+                case 0x0007: return chip8_op_FX07;
+                case 0x000A: return chip8_op_FX0A;
+                case 0x0015: return chip8_op_FX15;
+                case 0x0018: return chip8_op_FX18;
+                case 0x001E: return chip8_op_FX1E;
+                case 0x0029: return chip8_op_FX29;
+                case 0x0030: return chip8_op_FX30;
+                case 0x0033: return chip8_op_FX33;
+                case 0x003A: return chip8_op_FX3A;
+                case 0x0055: return chip8_op_FX55;
+                case 0x0065: return chip8_op_FX65;
+                case 0x0075: return chip8_op_FX75;
+                case 0x0085: return chip8_op_FX85;
+                default:     return chip8_op_invalid;
+            }
+    }
+    return chip8_op_invalid;
+}
+
+static void
+chip8_decode(const chip8* c, u16 addr, chip8_instr* in) {
+
+    u16 opcode = c->memory[addr] << 8 | c->memory[(u16)(addr + 1)];
+    in->opcode = opcode;
+    in->nnn = opcode & 0x0FFF;
+    in->x = (opcode & 0x0F00) >> 8;
+    in->y = (opcode & 0x00F0) >> 4;
+    in->n = opcode & 0x000F;
+    in->nn = opcode & 0x00FF;
+    in->handler = chip8_decode_handler(opcode);
+    if(in->handler == chip8_op_F000) {
+        in->nnn = c->memory[(u16)(addr + 2)] << 8 | c->memory[(u16)(addr + 3)];
+    }
+}
+
+// Every handler in a fixed order, the threaded core jumps through it, the
+// profiler counts by it and the static recompiler (aot.c) names them by it.
+#define CHIP8_OPS(FN) \
+    FN(invalid) FN(00E0) FN(00EE) FN(1NNN) FN(2NNN) FN(3XNN) FN(4XNN) FN(5XY0) \
+    FN(6XNN) FN(7XNN) FN(8XY0) FN(8XY1) FN(8XY2) FN(8XY3) FN(8XY4) FN(8XY5) \
+    FN(8XY6) FN(8XY7) FN(8XYE) FN(9XY0) FN(ANNN) FN(BNNN) FN(CXNN) FN(DXYN) \
+    FN(EX9E) FN(EXA1) FN(FX07) FN(FX0A) FN(FX15) FN(FX18) FN(FX1E) FN(FX29) \
+    FN(FX33) FN(FX55) FN(FX65) \
+    FN(00CN) FN(00DN) FN(00FB) FN(00FC) FN(00FD) FN(00FE) FN(00FF) FN(5XY2) \
+    FN(5XY3) FN(F000) FN(FN01) FN(FX30) FN(FX75) FN(FX85) FN(F002) FN(FX3A)
+
+#if defined(CHIP8_THREADED_DISPATCH) || defined(CHIP8_PROFILE)
+#define CHIP8_OP_HANDLER(NAME) chip8_op_##NAME,
+static const chip8_handler chip8OpHandlers[] = { CHIP8_OPS(CHIP8_OP_HANDLER) };
+#undef CHIP8_OP_HANDLER
+
+#define CHIP8_OP_COUNT SIZEOF_ARRAY(chip8OpHandlers)
+
+// opcode -> index into chip8OpHandlers, filled before main runs
+static u8 chip8OpIndex[0x10000];
+
+__attribute__((constructor)) static void
+chip8_build_op_index() {
+    for(u32 opcode = 0; opcode < 0x10000; opcode++) {
+        chip8_handler h = chip8_decode_handler((u16)opcode);
+        for(u32 i = 0; i < CHIP8_OP_COUNT; i++) {
+            if(chip8OpHandlers[i] == h) {
+                chip8OpIndex[opcode] = (u8)i;
+                break;
+            }
+        }
+    }
+}
+#endif
+
+#ifdef CHIP8_PROFILE
+#include "profiler.h"
+#define CHIP8_PROFILE_STEP(C, PC, IN) \
+    do{ if((C)->profile) chip8_profile_step((C)->profile, (PC), (IN), (C)->stackpointer); }while(0)
+#else
+#define CHIP8_PROFILE_STEP(C, PC, IN)
+#endif
+
+#ifdef CHIP8_COVERAGE
+#define CHIP8_COVERAGE_STEP(C, PC) \
+    do{ if((C)->coverage) (C)->coverage[(PC)] += (C)->coverage[(PC)] != 0xFF; }while(0)
+#else
+#define CHIP8_COVERAGE_STEP(C, PC)
+#endif
+
+static void
+chip8_cycle(chip8* c) {
+
+#ifdef CHIP8_NO_DECODE_CACHE
+    chip8_instr decoded;
+    chip8_instr* in = &decoded;
+    chip8_decode(c, c->pc, in);
+#else
+    chip8_instr* in = &c->decoded[c->pc];
+    if(!in->handler) {
+        chip8_decode(c, c->pc, in);
+    }
+#endif
+#if 0 // For debugging
+    printf ("Executing %04X at %04X , I:%02X SP:%02X V0: %d\n",
+           in->opcode, c->pc, c->IReqister, c->stackpointer, (int)c->VRegisters[0]);
+#endif
+    CHIP8_PROFILE_STEP(c, c->pc, in);
+    CHIP8_COVERAGE_STEP(c, c->pc);
+
+    in->handler(c, in);
+}
+
+#ifdef CHIP8_THREADED_DISPATCH
+// Threaded interpreter core, every handler body ends in its own indirect
+// jump to the next one (computed goto) instead of all instructions sharing
+// one hard to predict dispatch branch. The opcode -> handler mapping comes
+// from chip8_decode_handler so both cores agree on what every opcode means.
+
+// gcc merges the replicated dispatch tails back into one without these
+__attribute__((optimize("no-crossjumping", "no-gcse"))) static u32
+chip8_run(chip8* c, u32 count) {
+
+#define CHIP8_OP_LABEL(NAME) &&op_##NAME,
+    static const void* labels[] = { CHIP8_OPS(CHIP8_OP_LABEL) };
+#undef CHIP8_OP_LABEL
+
+    u32 executed = 0;
+    u16 pc;
+    chip8_instr* in;
+    if(c->trap) return 0;
+
+#define DISPATCH() \
+    do{ \
+        if(executed == count) goto done; \
+        pc = c->pc; \
+        in = &c->decoded[pc]; \
+        if(!in->handler) chip8_decode(c, pc, in); \
+        CHIP8_PROFILE_STEP(c, pc, in); \
+        CHIP8_COVERAGE_STEP(c, pc); \
+        goto *labels[chip8OpIndex[in->opcode]]; \
+    }while(0)
+
+#define CHIP8_OP_BODY(NAME) \
+    op_##NAME: \
+        chip8_op_##NAME(c, in); \
+        executed += 1; \
+        if(c->pc == pc) goto done; \
+        DISPATCH();
+
+    DISPATCH();
+    CHIP8_OPS(CHIP8_OP_BODY)
+
+#undef CHIP8_OP_BODY
+#undef DISPATCH
+done:
+    return executed;
+}
+
+#else
+
+// Runs up to count instructions, returns how many were executed.
+// Stops early if the machine stalls (jump to itself or waiting for a key),
+// running it further can't change anything until timers or input do.
+// A trap stops it the same way, with c->trap saying which.
+static u32
+chip8_run(chip8* c, u32 count) {
+
+    u32 executed = 0;
+    if(c->trap) return 0;
+    while(executed < count) {
+        u16 pc = c->pc;
+#ifdef CHIP8_NO_DECODE_CACHE
+        chip8_instr decoded;
+        chip8_instr* in = &decoded;
+        chip8_decode(c, pc, in);
+#else
+        chip8_instr* in = &c->decoded[pc];
+        if(!in->handler) {
+            chip8_decode(c, pc, in);
+        }
+#endif
+        CHIP8_PROFILE_STEP(c, pc, in);
+        CHIP8_COVERAGE_STEP(c, pc);
+        in->handler(c, in);
+        executed += 1;
+        if(c->pc == pc) break;
+    }
+    return executed;
+}
+
+#endif
+
+static void
+chip8_tick_timers(chip8* c) {
+
+    if(c->delayTimer > 0)
+        c->delayTimer -= 1;
+
+    if(c->soundTimer > 0)
+        c->soundTimer -= 1;
+}
+
+#endif /* CHIP8_H */
@@ -0,0 +1,214 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Fuzz target for the core. An input is a rom, as is, so real games make a
+// corpus. It runs up to CHIP8_FUZZ_FRAMES frames of CHIP8_FUZZ_IPF
+// instructions with CHIP8_FUZZ_QUIRKS and keys taken from the rom bytes,
+// until it stalls or traps. Traps are ordinary results, anything the sanitizers or
+// the asserts below catch is a finding.
+//
+// Every executed guest address bumps a counter, with libFuzzer those are
+// extra counters so the fuzzer sees which parts of the rom ran:
+//
+//  clang -g -O1 -fsanitize=fuzzer,address -DCHIP8_LIBFUZZER fuzz.c -o chip8-libfuzzer
+//  ./chip8-libfuzzer -max_len=4096 corpus/
+//
+// Built without CHIP8_LIBFUZZER (build.sh) it is a plain driver instead:
+//
+//  chip8-fuzz file...     runs each file as an input, reproduces findings
+//  chip8-fuzz -n runs     runs random inputs, prints execs/s and coverage
+//
+// The machine is reused between inputs, see fuzz_restore, which keeps an
+// input to a few microseconds.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CHIP8_COVERAGE
+#define CHIP8_COVERAGE
+#endif
+
+#include "defs.h"
+#include "fileload.h"
+#include "chip8.h"
+#include "savestate.h"
+#include "inputlog.h"
+
+#ifndef CHIP8_FUZZ_FRAMES
+#define CHIP8_FUZZ_FRAMES 64 // 640 instructions, a few microseconds
+#endif
+#ifndef CHIP8_FUZZ_IPF
+#define CHIP8_FUZZ_IPF 10
+#endif
+#ifndef CHIP8_FUZZ_QUIRKS
+#define CHIP8_FUZZ_QUIRKS 0
+#endif
+
+#ifdef CHIP8_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+static u8 fuzzCoverage[CHIP8_MEMORY_SIZE];
+
+static chip8*      fuzzMachine;
+static chip8_state fuzzBoot;    // initialised, no rom
+static u32         fuzzRomEnd;  // past the last input's rom
+
+static void
+fuzz_setup() {
+    fuzzMachine = calloc(1, sizeof(chip8));
+    assert(fuzzMachine);
+    chip8_init(fuzzMachine);
+    fuzzMachine->coverage = fuzzCoverage;
+    chip8_save_state(fuzzMachine, &fuzzBoot);
+    fuzzRomEnd = PC_START_LOC;
+    // traps dump nothing here, the trace path is only for frontends
+    chip8TracePath = "/dev/null";
+}
+
+// fuzzBoot with rom loaded. Memory can only differ from that where the
+// last rom went and where the last run wrote. Decoding is a good part of a
+// short run, so only decodes that read a byte that really changes are
+// dropped, consecutive inputs are mostly the same.
+static void
+fuzz_restore(chip8* c, const u8* rom, u32 size) {
+
+    const u8* boot = fuzzBoot.machine;
+    u32 romEnd = PC_START_LOC + size;
+    u32 lo = PC_START_LOC;
+    u32 hi = romEnd > fuzzRomEnd ? romEnd : fuzzRomEnd;
+    if(c->dirtyLo < c->dirtyHi) {
+        if(c->dirtyLo < lo) lo = c->dirtyLo;
+        if(c->dirtyHi > hi) hi = c->dirtyHi;
+    }
+    for(u32 i = lo; i < hi; i++) {
+        u8 byte = i >= PC_START_LOC && i < romEnd ? rom[i - PC_START_LOC] : boot[offsetof(chip8, memory) + i];
+        if(c->memory[i] == byte) continue;
+        c->memory[i] = byte;
+        for(u32 k = i > 3 ? i - 3 : 0; k <= i; k++) c->decoded[k].handler = NULL;
+    }
+    fuzzRomEnd = romEnd;
+
+    memcpy(c->canvas, boot + offsetof(chip8, canvas), sizeof(c->canvas));
+    memcpy(&c->rngState, boot + offsetof(chip8, rngState), CHIP8_STATE_SIZE - offsetof(chip8, rngState));
+    c->dirtyLo = c->dirtyHi = 0;
+    c->trap = chip8_trap_none;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+
+    if(!fuzzMachine) fuzz_setup();
+    if(size == 0 || size >= CHIP8_MEMORY_SIZE - PC_START_LOC) return 0;
+    chip8* c = fuzzMachine;
+    const u8* rom = data;
+    fuzz_restore(c, rom, (u32)size);
+    c->quirks = CHIP8_FUZZ_QUIRKS;
+
+    for(u32 frame = 0; frame < CHIP8_FUZZ_FRAMES; frame++) {
+        // a key from the rom every other frame, so key waits and
+        // skips go both ways
+        u16 keys = frame & 1 ? 0 : (u16)(1 << (rom[frame % size] & 0xF));
+        u32 ran = chip8_run_frame(c, keys, CHIP8_FUZZ_IPF);
+        // stalled for good unless it's waiting on a key
+        u16 opcode = c->memory[c->pc] << 8 | c->memory[(u16)(c->pc + 1)];
+        if(ran < CHIP8_FUZZ_IPF && (c->trap || (opcode & 0xF0FF) != 0xF00A)) break;
+    }
+
+    assert(c->stackpointer <= 16);
+    assert(c->trap <= chip8_trap_stack);
+    return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+
+static u64
+time_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static u32
+fuzz_covered() {
+    u32 covered = 0;
+    for(u32 i = 0; i < CHIP8_MEMORY_SIZE; i++) covered += fuzzCoverage[i] != 0;
+    return covered;
+}
+
+static void
+usage(const char* name) {
+    printf("usage: %s [-n runs] [-s seed] [-m max size] [input...]\n", name);
+}
+
+int
+main(int argc, char** argv) {
+
+    u64 runs = 0;
+    u32 seed = 1;
+    u32 maxSize = 512;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:m:h")) != -1) {
+        switch(opt) {
+            case 'n': runs = strtoull(optarg, NULL, 10); break;
+            case 's': seed = (u32)strtoul(optarg, NULL, 10); break;
+            case 'm': maxSize = (u32)strtoul(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if((runs == 0 && optind >= argc) || maxSize == 0 || maxSize > CHIP8_MEMORY_SIZE - PC_START_LOC) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    fuzz_setup();
+
+    for(i32 i = optind; i < argc; i++) {
+        size_t size;
+        u8* data = load_binary_file(argv[i], &size);
+        if(!data) {
+            printf("%s not found\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        LLVMFuzzerTestOneInput(data, size);
+        printf("%s %s\n", argv[i], chip8TrapNames[fuzzMachine->trap]);
+        free(data);
+    }
+
+    if(runs) {
+        // unguided, random bytes are mostly bad opcodes but it shows the
+        // cost of an input and exercises the reset
+        u8* data = malloc(maxSize);
+        assert(data);
+        u64 traps[SIZEOF_ARRAY(chip8TrapNames)] = {0};
+        u32 x = seed ? seed : 1;
+        u64 start = time_now_ns();
+        for(u64 r = 0; r < runs; r++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            u32 size = 1 + x % maxSize;
+            for(u32 i = 0; i < size; i++) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                data[i] = (u8)x;
+            }
+            LLVMFuzzerTestOneInput(data, size);
+            traps[fuzzMachine->trap] += 1;
+        }
+        double seconds = (double)(time_now_ns() - start) / 1e9;
+        printf("%" PRIu64 " inputs in %.3fs (%.0f execs/s), %u addresses covered\n",
+                runs, seconds, (double)runs / seconds, fuzz_covered());
+        for(u32 i = 0; i < SIZEOF_ARRAY(traps); i++) {
+            printf("  %-18s %" PRIu64 "\n", chip8TrapNames[i], traps[i]);
+        }
+        free(data);
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif
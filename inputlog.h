@@ -0,0 +1,154 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include "defs.h"
+#include "chip8.h"
+#include "savestate.h"
+
+// Deterministic runs. A machine advances in frames, every frame sets the
+// keypad, runs up to instructionsPerFrame instructions (a stall uses up the
+// rest of the frame) and ticks the timers once, so time is counted in
+// instructions and not in wall clock. With the generator seeded the same,
+// the same keys on the same frames give the same machine, bit for bit.
+//
+// An input log holds the seed and frame size followed by one event per
+// keypad change, (frame, keys). The header also records how many frames
+// were run and the hash of the machine at the end so a replay can tell
+// whether it came out the same.
+
+#define CHIP8_INPUT_LOG_MAGIC   0x4E493843u // "C8IN"
+#define CHIP8_INPUT_LOG_VERSION 3 // 2: Fx0A stores the key and sees presses for the whole tick, 3: state layout 4
+
+typedef struct chip8_input_event {
+    u32 frame;
+    u16 keys;
+    u16 reserved;
+} chip8_input_event;
+
+typedef struct chip8_input_log_header {
+    u32 magic;
+    u32 version;
+    u32 seed;
+    u32 instructionsPerFrame;
+    u32 quirks;
+    u32 eventCount;
+    u64 frames;     // total frames recorded
+    u64 finalHash;  // chip8_state_hash after the last frame
+} chip8_input_log_header;
+
+typedef struct chip8_input_log {
+    chip8_input_log_header header;
+    chip8_input_event*     events;
+    u32                    capacity;
+    u16                    lastKeys;
+} chip8_input_log;
+
+static void
+chip8_input_log_init(chip8_input_log* log, u32 seed, u32 instructionsPerFrame, u32 quirks) {
+    memset(log, 0, sizeof(*log));
+    log->header.magic = CHIP8_INPUT_LOG_MAGIC;
+    log->header.version = CHIP8_INPUT_LOG_VERSION;
+    log->header.seed = seed;
+    log->header.instructionsPerFrame = instructionsPerFrame;
+    log->header.quirks = quirks;
+}
+
+static void
+chip8_input_log_dispose(chip8_input_log* log) {
+    if(log->events) free(log->events);
+}
+
+// Logs keys for frame if they differ from what was logged last.
+static void
+chip8_input_log_record(chip8_input_log* log, u32 frame, u16 keys) {
+    if(keys == log->lastKeys) return;
+    if(log->header.eventCount == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 256;
+        log->events = realloc(log->events, log->capacity * sizeof(chip8_input_event));
+        assert(log->events);
+    }
+    log->events[log->header.eventCount++] = (chip8_input_event){ frame, keys, 0 };
+    log->lastKeys = keys;
+}
+
+// Machine ready to record or replay this log from the start, the rom is
+// expected to be loaded already.
+static void
+chip8_input_log_setup(const chip8_input_log* log, chip8* c) {
+    chip8_seed(c, log->header.seed);
+    c->quirks = (u8)log->header.quirks;
+}
+
+static u32
+chip8_run_frame(chip8* c, u16 keys, u32 instructionsPerFrame) {
+    chip8_set_keys(c, keys);
+    u32 ran = chip8_run(c, instructionsPerFrame);
+    chip8_tick_timers(c);
+    return ran;
+}
+
+static i32
+chip8_input_log_write(chip8_input_log* log, const char* path, u64 frames, u64 finalHash) {
+    log->header.frames = frames;
+    log->header.finalHash = finalHash;
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        printf("failed to open %s\n", path);
+        return 0;
+    }
+    i32 ok = fwrite(&log->header, sizeof(log->header), 1, fp) == 1;
+    if(log->header.eventCount) {
+        ok = ok && fwrite(log->events, sizeof(chip8_input_event), log->header.eventCount, fp) == log->header.eventCount;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if(!ok) printf("failed to write %s\n", path);
+    return ok;
+}
+
+static i32
+chip8_input_log_read(chip8_input_log* log, const char* path) {
+    memset(log, 0, sizeof(*log));
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        printf("%s not found\n", path);
+        return 0;
+    }
+    i32 ok = fread(&log->header, sizeof(log->header), 1, fp) == 1 &&
+        log->header.magic == CHIP8_INPUT_LOG_MAGIC &&
+        log->header.version == CHIP8_INPUT_LOG_VERSION;
+    if(ok && log->header.eventCount) {
+        log->capacity = log->header.eventCount;
+        log->events = malloc(log->capacity * sizeof(chip8_input_event));
+        assert(log->events);
+        ok = fread(log->events, sizeof(chip8_input_event), log->capacity, fp) == log->capacity;
+    }
+    fclose(fp);
+    if(!ok) {
+        printf("%s is not an input log\n", path);
+        chip8_input_log_dispose(log);
+    }
+    return ok;
+}
+
+// Runs the whole log on c as fast as it goes, returns the number of
+// instructions executed. c must be freshly set up with the same rom.
+static u64
+chip8_input_log_replay(const chip8_input_log* log, chip8* c) {
+    chip8_input_log_setup(log, c);
+    u64 executed = 0;
+    u32 next = 0;
+    u16 keys = 0;
+    for(u64 frame = 0; frame < log->header.frames; frame++) {
+        while(next < log->header.eventCount && log->events[next].frame == frame) {
+            keys = log->events[next++].keys;
+        }
+        executed += chip8_run_frame(c, keys, log->header.instructionsPerFrame);
+    }
+    return executed;
+}
+
+#endif /* INPUTLOG_H */
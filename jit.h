@@ -0,0 +1,473 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef JIT_H
+#define JIT_H
+
+// Dynamic recompiler for x86-64, translates straight line chip8 code into
+// native blocks. Simple ALU/register ops are emitted inline, anything with
+// side effects or validation calls the same chip8_op_* handler the
+// interpreter uses, so the interpreter stays the reference for semantics.
+//
+// A block ends on a branch (1NNN 2NNN 00EE skips) or a memory write
+// (Fx33 Fx55 5XY2). Blocks chain to each other directly when the target is
+// already compiled, otherwise through the per address table. Instructions
+// the translator doesn't handle (BNNN, Fx0A, F000 NNNN, 00FD, jumps to
+// self, bad opcodes) are handed back to the interpreter. Writes into translated code are
+// caught through chip8_invalidate's dirty range and flush the whole cache.
+//
+// Every block is emitted twice. When the budget covers the whole block it's
+// taken at once on entry, otherwise a counted copy takes it one instruction
+// at a time and leaves when it runs out, so a budget smaller than the block
+// (a tick's worth in chip8-batch) still runs native.
+
+#include <stddef.h>
+#include "chip8.h"
+
+#if defined(__x86_64__) && defined(LINUX_PLATFORM)
+#define CHIP8_JIT_AVAILABLE 1
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64
+#define JIT_MAX_INSTR_BYTES 112
+#define JIT_COUNT_BYTES 32 // jit_count_one
+
+enum {
+    jit_exit_normal = 0, // pc points to code that has no block yet
+    jit_exit_stall  = 1, // instruction left pc where it was
+    jit_exit_budget = 2, // ran out of budget, pc is the next instruction
+};
+
+typedef i32 (*jit_enter_fn)(chip8* c, void** table, u64* remaining, void* entry);
+
+typedef struct chip8_jit {
+    u8*          code;
+    u32          used;
+    u32          codeStart;
+    jit_enter_fn enter;
+    u8*          exitNormal;
+    u8*          exitStall;
+    u8*          exitBudget;
+
+    void*        table[CHIP8_MEMORY_SIZE];   // block entry per guest address
+    u8           covered[CHIP8_MEMORY_SIZE]; // guest bytes read by compiled code
+    chip8_instr  instrs[CHIP8_MEMORY_SIZE];  // operands passed to handler calls
+
+    u64          blocks;
+    u64          flushes;
+} chip8_jit;
+
+#define JIT_OFF(FIELD) ((i32)offsetof(chip8, FIELD))
+#define JIT_V(X) (JIT_OFF(VRegisters) + (i32)(X))
+
+static inline void jit_u8(chip8_jit* j, u8 v)   { j->code[j->used++] = v; }
+static inline void jit_u16(chip8_jit* j, u16 v) { memcpy(j->code + j->used, &v, 2); j->used += 2; }
+static inline void jit_u32(chip8_jit* j, u32 v) { memcpy(j->code + j->used, &v, 4); j->used += 4; }
+static inline void jit_u64(chip8_jit* j, u64 v) { memcpy(j->code + j->used, &v, 8); j->used += 8; }
+
+static inline void
+jit_bytes(chip8_jit* j, const u8* bytes, u32 count) {
+    memcpy(j->code + j->used, bytes, count);
+    j->used += count;
+}
+
+// <op> with a [rbx + disp32] operand, rbx always holds the chip8*
+static inline void
+jit_rbx(chip8_jit* j, const u8* op, u32 opLen, u8 reg, i32 disp) {
+    jit_bytes(j, op, opLen);
+    jit_u8(j, 0x80 | (reg << 3) | 0x3);
+    jit_u32(j, (u32)disp);
+}
+
+#define JIT_RBX(J, REG, DISP, ...) \
+    do{ static const u8 op_[] = {__VA_ARGS__}; jit_rbx((J), op_, sizeof(op_), (REG), (DISP)); }while(0)
+
+// rel32 jumps, returns where the displacement lives for patching
+static inline u32
+jit_jcc(chip8_jit* j, u8 cc) {
+    jit_u8(j, 0x0F); jit_u8(j, cc);
+    u32 at = j->used;
+    jit_u32(j, 0);
+    return at;
+}
+
+static inline void
+jit_patch(chip8_jit* j, u32 at, const u8* target) {
+    i32 rel = (i32)(target - (j->code + at + 4));
+    memcpy(j->code + at, &rel, 4);
+}
+
+static inline void
+jit_jmp(chip8_jit* j, const u8* target) {
+    jit_u8(j, 0xE9);
+    u32 at = j->used;
+    jit_u32(j, 0);
+    jit_patch(j, at, target);
+}
+
+static inline void
+jit_set_pc(chip8_jit* j, u16 pc) {
+    JIT_RBX(j, 0, JIT_OFF(pc), 0x66, 0xC7); // mov word [pc], imm16
+    jit_u16(j, pc);
+}
+
+// left is how many instructions of the block come after this one, a
+// trap gives them back to the budget and leaves like a stall
+static void
+jit_call_handler(chip8_jit* j, u16 addr, u32 left) {
+    jit_set_pc(j, addr);
+    static const u8 movRdiRbx[] = {0x48, 0x89, 0xDF};
+    jit_bytes(j, movRdiRbx, sizeof(movRdiRbx));
+    jit_u8(j, 0x48); jit_u8(j, 0xBE); jit_u64(j, (u64)(uintptr_t)&j->instrs[addr]); // mov rsi, imm64
+    jit_u8(j, 0x48); jit_u8(j, 0xB8); jit_u64(j, (u64)(uintptr_t)j->instrs[addr].handler); // mov rax, imm64
+    jit_u8(j, 0xFF); jit_u8(j, 0xD0); // call rax
+
+    JIT_RBX(j, 7, JIT_OFF(trap), 0x80); jit_u8(j, 0);                      // cmp byte [trap], 0
+    u32 running = jit_jcc(j, 0x84);                                        // je running
+    if(left) {
+        jit_u8(j, 0x49); jit_u8(j, 0x81); jit_u8(j, 0xC4); jit_u32(j, left); // add r12, left
+    }
+    jit_jmp(j, j->exitStall);
+    jit_patch(j, running, j->code + j->used);
+}
+
+// continue at a pc known at compile time
+static void
+jit_exit_static(chip8_jit* j, u16 target, u16 blockStart, const u8* blockEntry) {
+    jit_set_pc(j, target);
+    if(target == blockStart) {
+        jit_jmp(j, blockEntry);
+    } else if(j->table[target]) {
+        jit_jmp(j, j->table[target]);
+    } else {
+        jit_u8(j, 0x49); jit_u8(j, 0x8B); jit_u8(j, 0x85); // mov rax, [r13 + disp32]
+        jit_u32(j, (u32)target * 8);
+        static const u8 testRax[] = {0x48, 0x85, 0xC0};
+        jit_bytes(j, testRax, sizeof(testRax));
+        jit_patch(j, jit_jcc(j, 0x84), j->exitNormal);
+        jit_u8(j, 0xFF); jit_u8(j, 0xE0); // jmp rax
+    }
+}
+
+// continue at whatever pc the handler left
+static void
+jit_exit_dynamic(chip8_jit* j, u16 addr) {
+    JIT_RBX(j, 0, JIT_OFF(pc), 0x0F, 0xB7); // movzx eax, word [pc]
+    jit_u8(j, 0x66); jit_u8(j, 0x3D); jit_u16(j, addr); // cmp ax, addr
+    jit_patch(j, jit_jcc(j, 0x84), j->exitStall);
+    static const u8 lookup[] = {
+        0x49, 0x8B, 0x44, 0xC5, 0x00, // mov rax, [r13 + rax*8]
+        0x48, 0x85, 0xC0,             // test rax, rax
+    };
+    jit_bytes(j, lookup, sizeof(lookup));
+    jit_patch(j, jit_jcc(j, 0x84), j->exitNormal);
+    jit_u8(j, 0xFF); jit_u8(j, 0xE0); // jmp rax
+}
+
+static void
+jit_emit_trampoline(chip8_jit* j) {
+
+    static const u8 enter[] = {
+        0x53,             // push rbx
+        0x41, 0x54,       // push r12
+        0x41, 0x55,       // push r13
+        0x41, 0x56,       // push r14
+        0x41, 0x57,       // push r15, keeps rsp 16 aligned for handler calls
+        0x48, 0x89, 0xFB, // mov rbx, rdi   chip8*
+        0x49, 0x89, 0xF5, // mov r13, rsi   block table
+        0x49, 0x89, 0xD6, // mov r14, rdx   &remaining
+        0x4C, 0x8B, 0x22, // mov r12, [rdx] instructions left
+        0xFF, 0xE1,       // jmp rcx        first block
+    };
+    j->enter = (jit_enter_fn)(void*)j->code;
+    jit_bytes(j, enter, sizeof(enter));
+
+    j->exitBudget = j->code + j->used;
+    static const u8 budget[] = {0xB8, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x09}; // mov eax, 2; jmp common
+    jit_bytes(j, budget, sizeof(budget));
+    j->exitStall = j->code + j->used;
+    static const u8 stall[] = {0xB8, 0x01, 0x00, 0x00, 0x00, 0xEB, 0x02}; // mov eax, 1; jmp common
+    jit_bytes(j, stall, sizeof(stall));
+    j->exitNormal = j->code + j->used;
+    static const u8 leave[] = {
+        0x31, 0xC0,       // xor eax, eax
+        0x4D, 0x89, 0x26, // mov [r14], r12
+        0x41, 0x5F,       // pop r15
+        0x41, 0x5E,       // pop r14
+        0x41, 0x5D,       // pop r13
+        0x41, 0x5C,       // pop r12
+        0x5B,             // pop rbx
+        0xC3,             // ret
+    };
+    jit_bytes(j, leave, sizeof(leave));
+    j->codeStart = j->used;
+}
+
+static void
+jit_flush(chip8_jit* j) {
+    memset(j->table, 0, sizeof(j->table));
+    memset(j->covered, 0, sizeof(j->covered));
+    j->used = j->codeStart;
+    j->flushes += 1;
+}
+
+static chip8_jit*
+jit_create() {
+
+    chip8_jit* j = calloc(1, sizeof(chip8_jit));
+    if(!j) return NULL;
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(j->code == MAP_FAILED) {
+        free(j);
+        return NULL;
+    }
+    jit_emit_trampoline(j);
+    return j;
+}
+
+static void
+jit_dispose(chip8_jit* j) {
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j);
+}
+
+typedef enum jit_kind {
+    jit_kind_native,    // inline code, falls through
+    jit_kind_call,      // handler call, falls through
+    jit_kind_end,       // last instruction of the block
+    jit_kind_interpret, // never translated, block stops before it
+} jit_kind;
+
+static jit_kind
+jit_classify(const chip8_instr* in, u16 addr) {
+
+    chip8_handler h = in->handler;
+    u8 x = in->x, y = in->y;
+
+    if(h == chip8_op_invalid || h == chip8_op_FX0A || h == chip8_op_BNNN ||
+       h == chip8_op_F000 || h == chip8_op_00FD) return jit_kind_interpret;
+    if((h == chip8_op_1NNN || h == chip8_op_2NNN) && in->nnn == addr) return jit_kind_interpret;
+
+    if(h == chip8_op_1NNN || h == chip8_op_2NNN || h == chip8_op_00EE ||
+       h == chip8_op_3XNN || h == chip8_op_4XNN || h == chip8_op_5XY0 || h == chip8_op_9XY0 ||
+       h == chip8_op_EX9E || h == chip8_op_EXA1 || h == chip8_op_FX33 || h == chip8_op_FX55 ||
+       h == chip8_op_5XY2) {
+        return jit_kind_end;
+    }
+    if(h == chip8_op_6XNN || h == chip8_op_7XNN || h == chip8_op_ANNN ||
+       h == chip8_op_8XY0 || h == chip8_op_8XY1 || h == chip8_op_8XY2 || h == chip8_op_8XY3 ||
+       h == chip8_op_FX07 || h == chip8_op_FX15 || h == chip8_op_FX18) {
+        return jit_kind_native;
+    }
+    // flag writers are only inlined when VF isn't also an operand
+    if((h == chip8_op_8XY4 || h == chip8_op_8XY5) && x != 0xF && y != 0xF) return jit_kind_native;
+    if((h == chip8_op_8XYE || h == chip8_op_FX1E) && x != 0xF) return jit_kind_native;
+    return jit_kind_call;
+}
+
+static void
+jit_emit_native(chip8_jit* j, const chip8_instr* in) {
+
+    chip8_handler h = in->handler;
+    i32 vx = JIT_V(in->x), vy = JIT_V(in->y), vf = JIT_V(0xF);
+
+    if(h == chip8_op_6XNN) {
+        JIT_RBX(j, 0, vx, 0xC6); jit_u8(j, in->nn);              // mov byte [vx], nn
+    } else if(h == chip8_op_7XNN) {
+        JIT_RBX(j, 0, vx, 0x80); jit_u8(j, in->nn);              // add byte [vx], nn
+    } else if(h == chip8_op_ANNN) {
+        JIT_RBX(j, 0, JIT_OFF(IReqister), 0x66, 0xC7); jit_u16(j, in->nnn);
+    } else if(h == chip8_op_8XY0) {
+        JIT_RBX(j, 0, vy, 0x8A);                                 // mov al, [vy]
+        JIT_RBX(j, 0, vx, 0x88);                                 // mov [vx], al
+    } else if(h == chip8_op_8XY1 || h == chip8_op_8XY2 || h == chip8_op_8XY3) {
+        JIT_RBX(j, 0, vy, 0x8A);
+        u8 op = h == chip8_op_8XY1 ? 0x08 : h == chip8_op_8XY2 ? 0x20 : 0x30;
+        jit_rbx(j, &op, 1, 0, vx);                               // or/and/xor [vx], al
+    } else if(h == chip8_op_8XY4 || h == chip8_op_8XY5) {
+        JIT_RBX(j, 0, vx, 0x8A);                                 // mov al, [vx]
+        if(h == chip8_op_8XY4) {
+            JIT_RBX(j, 0, vy, 0x02);                             // add al, [vy]
+            jit_u8(j, 0x0F); jit_u8(j, 0x92); jit_u8(j, 0xC2);   // setc dl
+        } else {
+            JIT_RBX(j, 0, vy, 0x2A);                             // sub al, [vy]
+            jit_u8(j, 0x0F); jit_u8(j, 0x93); jit_u8(j, 0xC2);   // setnc dl
+        }
+        JIT_RBX(j, 0, vx, 0x88);                                 // mov [vx], al
+        JIT_RBX(j, 2, vf, 0x88);                                 // mov [vf], dl
+    } else if(h == chip8_op_8XYE) {
+        JIT_RBX(j, 0, vx, 0x8A);                                 // mov al, [vx]
+        static const u8 shift[] = {0x88, 0xC2, 0xC0, 0xEA, 0x07, 0x00, 0xC0}; // mov dl, al; shr dl, 7; add al, al
+        jit_bytes(j, shift, sizeof(shift));
+        JIT_RBX(j, 2, vf, 0x88);
+        JIT_RBX(j, 0, vx, 0x88);
+    } else if(h == chip8_op_FX07) {
+        JIT_RBX(j, 0, JIT_OFF(delayTimer), 0x8A);
+        JIT_RBX(j, 0, vx, 0x88);
+    } else if(h == chip8_op_FX15 || h == chip8_op_FX18) {
+        JIT_RBX(j, 0, vx, 0x8A);
+        JIT_RBX(j, 0, h == chip8_op_FX15 ? JIT_OFF(delayTimer) : JIT_OFF(soundTimer), 0x88);
+    } else if(h == chip8_op_FX1E) {
+        JIT_RBX(j, 0, vx, 0x0F, 0xB6);                           // movzx eax, byte [vx]
+        JIT_RBX(j, 0, JIT_OFF(IReqister), 0x66, 0x01);           // add word [I], ax
+        JIT_RBX(j, 7, JIT_OFF(IReqister), 0x66, 0x81); jit_u16(j, 0xFFF); // cmp word [I], 0xFFF
+        jit_u8(j, 0x0F); jit_u8(j, 0x97); jit_u8(j, 0xC2);       // seta dl
+        JIT_RBX(j, 2, vf, 0x88);
+    }
+}
+
+static void
+jit_emit_end(chip8_jit* j, const chip8* c, const chip8_instr* in, u16 addr, u16 start, const u8* entry) {
+
+    chip8_handler h = in->handler;
+    i32 vx = JIT_V(in->x), vy = JIT_V(in->y);
+    // skips jump over the whole next instruction, F000 NNNN is two words.
+    // The block covers the next word so a change to it recompiles this.
+    u16 next = addr + 2;
+    u16 skipTo = next + (c->memory[next] == 0xF0 && c->memory[(u16)(next + 1)] == 0x00 ? 4 : 2);
+
+    if(h == chip8_op_1NNN) {
+        jit_exit_static(j, in->nnn, start, entry);
+    } else if(h == chip8_op_2NNN) {
+        jit_call_handler(j, addr, 0); // stack push + validation
+        jit_exit_static(j, in->nnn, start, entry);
+    } else if(h == chip8_op_3XNN || h == chip8_op_4XNN || h == chip8_op_5XY0 || h == chip8_op_9XY0) {
+        if(h == chip8_op_3XNN || h == chip8_op_4XNN) {
+            JIT_RBX(j, 7, vx, 0x80); jit_u8(j, in->nn);          // cmp byte [vx], nn
+        } else {
+            JIT_RBX(j, 0, vx, 0x8A);                             // mov al, [vx]
+            JIT_RBX(j, 0, vy, 0x3A);                             // cmp al, [vy]
+        }
+        u8 skipWhen = (h == chip8_op_3XNN || h == chip8_op_5XY0) ? 0x84 : 0x85; // je / jne
+        u32 skip = jit_jcc(j, skipWhen);
+        jit_exit_static(j, addr + 2, start, entry);
+        jit_patch(j, skip, j->code + j->used);
+        jit_exit_static(j, skipTo, start, entry);
+    } else if(h == chip8_op_FX33 || h == chip8_op_FX55 || h == chip8_op_5XY2) {
+        // may have written over code, let the dispatcher look before going on
+        jit_call_handler(j, addr, 0);
+        jit_jmp(j, j->exitNormal);
+    } else {
+        jit_call_handler(j, addr, 0);
+        jit_exit_dynamic(j, addr);
+    }
+}
+
+// counted copy only, leaves with pc on addr when there's no budget for it
+static void
+jit_count_one(chip8_jit* j, u16 addr) {
+    static const u8 testR12[] = {0x4D, 0x85, 0xE4};
+    jit_bytes(j, testR12, sizeof(testR12));
+    u32 enough = jit_jcc(j, 0x85);                       // jnz enough
+    jit_set_pc(j, addr);
+    jit_jmp(j, j->exitBudget);
+    jit_patch(j, enough, j->code + j->used);
+    jit_u8(j, 0x49); jit_u8(j, 0xFF); jit_u8(j, 0xCC);   // dec r12
+}
+
+// The instructions from start up to end, counted or with the whole block
+// already taken from the budget
+static void
+jit_emit_block(chip8_jit* j, const chip8* c, u16 start, u16 end, i32 hasEnd, const u8* entry, i32 counted) {
+
+    u32 count = (u32)(end - start) / 2;
+    for(u16 addr = start; addr != end; addr += 2) {
+        const chip8_instr* in = &j->instrs[addr];
+        jit_kind kind = jit_classify(in, addr);
+        if(counted) jit_count_one(j, addr);
+        if(kind == jit_kind_native) {
+            jit_emit_native(j, in);
+        } else if(kind == jit_kind_call) {
+            jit_call_handler(j, addr, counted ? 0 : count - 1 - (u16)(addr - start) / 2);
+        } else {
+            jit_emit_end(j, c, in, addr, start, entry);
+        }
+    }
+    if(!hasEnd) {
+        jit_exit_static(j, end, start, entry);
+    }
+}
+
+static void*
+jit_compile(chip8_jit* j, chip8* c, u16 start) {
+
+    u16 end = start;
+    u32 count = 0;
+    i32 hasEnd = 0;
+    while(count < JIT_MAX_BLOCK && end + 3 < CHIP8_MEMORY_SIZE) {
+        chip8_instr* in = &j->instrs[end];
+        chip8_decode(c, end, in);
+        jit_kind kind = jit_classify(in, end);
+        if(kind == jit_kind_interpret) break;
+        count += 1;
+        end += 2;
+        if(kind == jit_kind_end) {
+            hasEnd = 1;
+            break;
+        }
+    }
+    if(count == 0) return NULL;
+
+    if(j->used + count * (2 * JIT_MAX_INSTR_BYTES + JIT_COUNT_BYTES) + 256 > JIT_CODE_SIZE) {
+        jit_flush(j);
+    }
+
+    u8* entry = j->code + j->used;
+    jit_u8(j, 0x49); jit_u8(j, 0x81); jit_u8(j, 0xFC); jit_u32(j, count); // cmp r12, count
+    u32 counted = jit_jcc(j, 0x82);                                      // jb counted
+    jit_u8(j, 0x49); jit_u8(j, 0x81); jit_u8(j, 0xEC); jit_u32(j, count); // sub r12, count
+    jit_emit_block(j, c, start, end, hasEnd, entry, 0);
+    jit_patch(j, counted, j->code + j->used);
+    jit_emit_block(j, c, start, end, hasEnd, entry, 1);
+
+    // one word past the end, skips look at it
+    u32 coverEnd = (u32)end + 2 < CHIP8_MEMORY_SIZE ? (u32)end + 2 : CHIP8_MEMORY_SIZE;
+    memset(j->covered + start, 1, coverEnd - start);
+    j->table[start] = entry;
+    j->blocks += 1;
+    return entry;
+}
+
+// Same contract as chip8_run
+static u32
+jit_run(chip8_jit* j, chip8* c, u32 count) {
+
+    u64 remaining = count;
+    if(c->trap) return 0;
+    while(remaining) {
+        if(c->dirtyLo < c->dirtyHi) {
+            for(u32 i = c->dirtyLo; i < c->dirtyHi; i++) {
+                if(j->covered[i]) {
+                    jit_flush(j);
+                    break;
+                }
+            }
+            c->dirtyLo = c->dirtyHi = 0;
+        }
+
+        u16 pc = c->pc;
+        void* entry = j->table[pc];
+        if(!entry) entry = jit_compile(j, c, pc);
+        if(!entry) {
+            remaining -= chip8_run(c, 1);
+            if(c->pc == pc) break;
+            continue;
+        }
+
+        i32 status = j->enter(c, j->table, &remaining, entry);
+        if(status == jit_exit_stall || status == jit_exit_budget) break;
+    }
+    return count - (u32)remaining;
+}
+
+#else
+
+static inline void* jit_create() { return NULL; }
+
+#endif
+
+#endif /* JIT_H */
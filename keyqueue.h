@@ -0,0 +1,74 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef KEYQUEUE_H
+#define KEYQUEUE_H
+
+#include "defs.h"
+
+// Keypad events between the frontend's input polling and the machine.
+// Every change is queued with the time it happened (CLOCK_MONOTONIC ns,
+// see scheduler.h) and handed to the machine one tick at a time. A tick
+// takes events in order until one would undo a change it already made, so
+// a tap shorter than a tick is still seen down for a whole tick instead
+// of being lost in between two samples of the keyboard.
+
+#define CHIP8_KEY_QUEUE_SIZE 64 // power of two
+
+typedef struct chip8_key_event {
+    u64 time;
+    u8  key;  // keypad 0 - F
+    u8  down;
+} chip8_key_event;
+
+typedef struct chip8_key_queue {
+    chip8_key_event events[CHIP8_KEY_QUEUE_SIZE];
+    u32             head;
+    u32             tail;
+    u32             dropped; // events that came in with the queue full
+} chip8_key_queue;
+
+static void
+chip8_key_queue_push(chip8_key_queue* q, u64 time, u8 key, u8 down) {
+    if(q->head - q->tail == CHIP8_KEY_QUEUE_SIZE) {
+        q->dropped += 1;
+        return;
+    }
+    q->events[q->head++ & (CHIP8_KEY_QUEUE_SIZE - 1)] = (chip8_key_event){ time, key, down, };
+}
+
+// The keypad for the next tick, starting from keys. pressTime gets the
+// time of the earliest key that went down in it, left alone if none did.
+static u16
+chip8_key_queue_tick(chip8_key_queue* q, u16 keys, u64* pressTime) {
+    u16 changed = 0;
+    while(q->tail != q->head) {
+        const chip8_key_event* e = &q->events[q->tail & (CHIP8_KEY_QUEUE_SIZE - 1)];
+        u16 bit = (u16)(1 << e->key);
+        if(changed & bit) break; // the next tick gets this one
+        if(e->down && !(keys & bit)) {
+            if(*pressTime == 0) *pressTime = e->time;
+            keys |= bit;
+            changed |= bit;
+        } else if(!e->down && (keys & bit)) {
+            keys &= ~bit;
+            changed |= bit;
+        }
+        q->tail += 1;
+    }
+    return keys;
+}
+
+// Everything queued at once, for when no ticks are running (rewinding)
+static u16
+chip8_key_queue_drain(chip8_key_queue* q, u16 keys) {
+    for(; q->tail != q->head; q->tail++) {
+        const chip8_key_event* e = &q->events[q->tail & (CHIP8_KEY_QUEUE_SIZE - 1)];
+        if(e->down) keys |= (u16)(1 << e->key);
+        else keys &= (u16)~(1 << e->key);
+    }
+    return keys;
+}
+
+#endif /* KEYQUEUE_H */
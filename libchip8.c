@@ -0,0 +1,202 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// libchip8.so, the step/observe interface in libchip8.h on top of the
+// headless core. Built with -fvisibility=hidden, only CHIP8_API functions
+// are exported.
+
+#define _GNU_SOURCE
+#include "defs.h"
+#include "chip8.h"
+#include "savestate.h"
+#include "inputlog.h"
+#include "lockstep.h"
+#include "libchip8.h"
+
+_Static_assert(sizeof(((chip8*)0)->canvas) ==
+        CHIP8_OBSERVATION_PLANES * CHIP8_OBSERVATION_COLUMNS * CHIP8_OBSERVATION_ROWS * sizeof(u64),
+        "libchip8.h framebuffer layout out of date");
+_Static_assert(CHIP8_TRAP_OPCODE == chip8_trap_opcode && CHIP8_TRAP_STACK == chip8_trap_stack,
+        "libchip8.h trap codes out of date");
+
+struct chip8_env {
+    chip8       machine;
+    chip8_state boot;     // right after load, what reset goes back to
+    u32         instructionsPerFrame;
+    u8          halted;
+    u64         frames;
+};
+
+struct chip8_env_batch {
+    chip8_lanes lanes;
+    chip8*      boot;
+    u64*        frames;   // per machine, since its last reset
+    u32         instructionsPerFrame;
+};
+
+// Back to the state in boot. Only decodes of memory the machine wrote since
+// boot can be stale, so unlike chip8_load_state the rest of the cache is kept.
+static void
+env_restore(chip8* c, const chip8_state* boot) {
+    memcpy(c, boot->machine, CHIP8_STATE_SIZE);
+    if(c->dirtyLo < c->dirtyHi) {
+        chip8_invalidate(c, c->dirtyLo, c->dirtyHi - c->dirtyLo);
+    }
+    c->dirtyLo = c->dirtyHi = 0;
+    c->trap = chip8_trap_none;
+}
+
+static void
+env_observe(const chip8* c, chip8_observation* obs) {
+    obs->framebuffer = c->canvas[0][0];
+    obs->memory = c->memory;
+    obs->registers = c->VRegisters;
+    obs->pc = c->pc;
+    obs->I = c->IReqister;
+    obs->delayTimer = c->delayTimer;
+    obs->soundTimer = c->soundTimer;
+    obs->hires = c->hires;
+    obs->trap = c->trap;
+}
+
+CHIP8_API chip8_env*
+chip8_env_create(uint32_t instructionsPerFrame, uint32_t quirks) {
+
+    if(instructionsPerFrame == 0) return NULL;
+    // calloc, the decode cache is most of the machine and stays untouched
+    // outside the code that runs
+    chip8_env* env = calloc(1, sizeof(chip8_env));
+    if(!env) return NULL;
+    chip8_init(&env->machine);
+    env->machine.quirks = (u8)quirks;
+    env->instructionsPerFrame = instructionsPerFrame;
+    chip8_save_state(&env->machine, &env->boot);
+    return env;
+}
+
+CHIP8_API void
+chip8_env_destroy(chip8_env* env) {
+    free(env);
+}
+
+CHIP8_API int
+chip8_env_load_rom(chip8_env* env, const uint8_t* rom, size_t size) {
+
+    chip8* c = &env->machine;
+    u8 quirks = c->quirks;
+    chip8_init(c);
+    c->quirks = quirks;
+    if(!chip8_load_rom(c, rom, size)) return 0;
+    c->dirtyLo = c->dirtyHi = 0;
+    chip8_save_state(c, &env->boot);
+    env->halted = 0;
+    env->frames = 0;
+    return 1;
+}
+
+CHIP8_API void
+chip8_env_reset(chip8_env* env, uint32_t seed) {
+    env_restore(&env->machine, &env->boot);
+    chip8_seed(&env->machine, seed);
+    env->halted = 0;
+    env->frames = 0;
+}
+
+CHIP8_API chip8_env*
+chip8_env_clone(const chip8_env* env) {
+
+    chip8_env* clone = calloc(1, sizeof(chip8_env));
+    if(!clone) return NULL;
+    // the decode cache is left empty and fills in on the first steps. The
+    // dirty range goes along, it's what a reset has to invalidate and the
+    // original's writes since boot are in memory here as well.
+    memcpy(&clone->machine, &env->machine, CHIP8_STATE_SIZE);
+    clone->machine.dirtyLo = env->machine.dirtyLo;
+    clone->machine.dirtyHi = env->machine.dirtyHi;
+    clone->boot = env->boot;
+    clone->instructionsPerFrame = env->instructionsPerFrame;
+    clone->halted = env->halted;
+    clone->frames = env->frames;
+    return clone;
+}
+
+CHIP8_API uint64_t
+chip8_env_step(chip8_env* env, uint16_t keys, uint32_t frames) {
+
+    u64 executed = 0;
+    for(u32 i = 0; i < frames; i++) {
+        u32 ran = chip8_run_frame(&env->machine, keys, env->instructionsPerFrame);
+        env->halted = ran < env->instructionsPerFrame;
+        executed += ran;
+    }
+    env->frames += frames;
+    return executed;
+}
+
+CHIP8_API void
+chip8_env_observe(const chip8_env* env, chip8_observation* obs) {
+    env_observe(&env->machine, obs);
+    obs->halted = env->halted;
+    obs->frames = env->frames;
+}
+
+CHIP8_API chip8_env_batch*
+chip8_env_batch_create(const chip8_env* env, uint32_t count) {
+
+    if(count == 0) return NULL;
+    chip8_env_batch* batch = calloc(1, sizeof(chip8_env_batch));
+    if(!batch) return NULL;
+    batch->boot = calloc(1, sizeof(chip8));
+    batch->frames = calloc(count, sizeof(u64));
+    if(!batch->boot || !batch->frames) {
+        goto fail;
+    }
+    chip8_load_state(batch->boot, &env->boot);
+    if(!chip8_lanes_create(&batch->lanes, batch->boot, count)) {
+        goto fail;
+    }
+    batch->instructionsPerFrame = env->instructionsPerFrame;
+    return batch;
+
+fail:
+    if(batch->boot) free(batch->boot);
+    if(batch->frames) free(batch->frames);
+    free(batch);
+    return NULL;
+}
+
+CHIP8_API void
+chip8_env_batch_destroy(chip8_env_batch* batch) {
+    chip8_lanes_dispose(&batch->lanes);
+    free(batch->boot);
+    free(batch->frames);
+    free(batch);
+}
+
+CHIP8_API uint64_t
+chip8_env_batch_step(chip8_env_batch* batch, const uint16_t* keys) {
+    for(u32 i = 0; i < batch->lanes.count; i++) batch->frames[i] += 1;
+    return chip8_lanes_frame(&batch->lanes, keys, batch->instructionsPerFrame);
+}
+
+CHIP8_API void
+chip8_env_batch_reset(chip8_env_batch* batch, uint32_t index, uint32_t seed) {
+    assert(index < batch->lanes.count);
+    chip8_lanes_reset(&batch->lanes, index, batch->boot);
+    chip8_lanes_seed(&batch->lanes, index, seed);
+    batch->frames[index] = 0;
+}
+
+CHIP8_API void
+chip8_env_batch_observe(chip8_env_batch* batch, uint32_t index, chip8_observation* obs) {
+
+    assert(index < batch->lanes.count);
+    chip8_lanes* L = &batch->lanes;
+    const chip8_lane_block* b = &L->blocks[index / CHIP8_LANE_WIDTH];
+    chip8* c = &L->machines[index];
+    lanes_spill(b, index % CHIP8_LANE_WIDTH, c);
+    env_observe(c, obs);
+    obs->halted = b->halted[index % CHIP8_LANE_WIDTH] != 0;
+    obs->frames = batch->frames[index];
+}
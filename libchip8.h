@@ -0,0 +1,127 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+// Public interface of libchip8.so, the emulator core without SDL for
+// training and automation code. Machines advance in frames exactly like
+// chip8-batch -i replays (see inputlog.h): set the keypad, run up to
+// instructionsPerFrame instructions, tick the timers once. No call
+// allocates or copies anything per step, create, clone and the batch
+// functions are the only ones that allocate.
+//
+// Everything works on the handle it's given and nothing else, so separate
+// environments can be stepped from separate threads without locking. One
+// environment must not be used from two threads at once. A guest error
+// (stack overflow, bad opcode, ...) stops the machine where it happened
+// until the next reset, the observation's trap says which.
+//
+//  chip8_env* env = chip8_env_create(10, 0);
+//  chip8_env_load_rom(env, rom, romSize);
+//  chip8_observation obs;
+//  chip8_env_observe(env, &obs);          // obs.framebuffer stays live
+//  for(;;) {
+//      chip8_env_step(env, keys, 1);
+//      ... read obs.framebuffer ...
+//  }
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+typedef struct chip8_env chip8_env;
+typedef struct chip8_env_batch chip8_env_batch;
+
+// Framebuffer layout, two bitplanes of 64 rows of 128 pixels:
+// uint64_t framebuffer[2][2][64], [plane][column][row]. Bit 63 of column 0
+// is the leftmost pixel of a row, bit 0 of column 1 the rightmost. In
+// lores (64x32) only column 0, rows 0-31 are used and the rest is clear.
+// Plain CHIP-8 programs only draw on plane 0.
+#define CHIP8_OBSERVATION_PLANES  2
+#define CHIP8_OBSERVATION_COLUMNS 2
+#define CHIP8_OBSERVATION_ROWS    64
+
+// chip8_observation.trap, the same as chip8_trap in chip8.h
+#define CHIP8_TRAP_NONE     0
+#define CHIP8_TRAP_OPCODE   1 // unknown opcode
+#define CHIP8_TRAP_REGISTER 2 // reserved, never reported
+#define CHIP8_TRAP_MEMORY   3 // access past the end of memory
+#define CHIP8_TRAP_KEY      4 // key past F in Ex9E/ExA1
+#define CHIP8_TRAP_FONT     5 // bad digit in Fx29/Fx30
+#define CHIP8_TRAP_STACK    6 // call too deep or return with nothing on the stack
+
+// The pointers point into the machine and stay valid (and current) until it
+// is destroyed, an observation can be taken once and read after every
+// step. The scalars are copies from when chip8_env_observe was called.
+typedef struct chip8_observation {
+    const uint64_t* framebuffer; // see above
+    const uint8_t*  memory;      // 64KB
+    const uint8_t*  registers;   // V0-VF
+
+    uint16_t pc;
+    uint16_t I;
+    uint8_t  delayTimer;
+    uint8_t  soundTimer;
+    uint8_t  hires;              // 128x64 instead of 64x32
+    uint8_t  halted;             // last frame stalled (jump to itself, waiting on a key, trapped)
+    uint8_t  trap;               // 0 while running, else what stopped it, CHIP8_TRAP_*
+    uint64_t frames;             // since the last reset
+} chip8_observation;
+
+// quirks are the CHIP8_QUIRK_* bits (chip8.h), 0 for the defaults.
+// Returns NULL if out of memory.
+CHIP8_API chip8_env* chip8_env_create(uint32_t instructionsPerFrame, uint32_t quirks);
+CHIP8_API void       chip8_env_destroy(chip8_env* env);
+
+// Boots a rom from memory, the machine as it is right after is what reset
+// goes back to. Returns 0 if the rom doesn't fit.
+CHIP8_API int        chip8_env_load_rom(chip8_env* env, const uint8_t* rom, size_t size);
+
+// Back to the freshly booted machine with the Cxnn generator seeded.
+CHIP8_API void       chip8_env_reset(chip8_env* env, uint32_t seed);
+
+// An independent copy of the machine and its boot state
+CHIP8_API chip8_env* chip8_env_clone(const chip8_env* env);
+
+// Runs frames frames with keys (bit n = key n down) held for all of them,
+// returns the instructions executed.
+CHIP8_API uint64_t   chip8_env_step(chip8_env* env, uint16_t keys, uint32_t frames);
+
+CHIP8_API void       chip8_env_observe(const chip8_env* env, chip8_observation* obs);
+
+// count machines booted from env's boot state, stepped one frame at a time
+// together. Machines at the same pc run an instruction once for all of
+// them as vector ops (lockstep.h), groups of machines that went their own
+// way are run one at a time. Their Cxnn generators all start out as env's,
+// reset them with their own seeds.
+CHIP8_API chip8_env_batch* chip8_env_batch_create(const chip8_env* env, uint32_t count);
+CHIP8_API void             chip8_env_batch_destroy(chip8_env_batch* batch);
+
+// One frame on every machine, keys holds one keypad mask per machine
+// (NULL for none pressed). Returns the instructions executed in total.
+CHIP8_API uint64_t         chip8_env_batch_step(chip8_env_batch* batch, const uint16_t* keys);
+
+CHIP8_API void             chip8_env_batch_reset(chip8_env_batch* batch, uint32_t index, uint32_t seed);
+
+// Same as chip8_env_observe for machine index. The batch keeps registers
+// elsewhere while running, they are written back to the machine here, so
+// registers is only current as of this call; framebuffer and memory are
+// always live.
+CHIP8_API void             chip8_env_batch_observe(chip8_env_batch* batch, uint32_t index, chip8_observation* obs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBCHIP8_H */
@@ -0,0 +1,494 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "defs.h"
+#include "chip8.h"
+#include "savestate.h"
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Lockstep engine, many machines booted from the same machine (same rom,
+// different seeds and input) run side by side. The registers the common
+// instructions touch, V0-VF, I, pc, timers, keypad and Cxnn generator, are
+// kept struct of arrays, one vector lane per machine in blocks of
+// CHIP8_LANE_WIDTH lanes. Each step picks the pc of the first lane that
+// still has to go, every lane in the block at that same pc runs the
+// instruction at once as vector ops, then the next pc, until all lanes
+// ran one. Lanes that agree cost one instruction per block, lanes that
+// diverged end up in groups of their own.
+//
+// Everything else (draws, memory, stack, the XO-CHIP extras) goes through
+// the interpreter's handlers one lane at a time, on that lane's struct
+// chip8 with the registers spilled into it and read back after. Code some
+// lane wrote to is also left to the handlers since the lanes can't be
+// assumed to agree on it anymore.
+//
+// Frames are the same as chip8_run_frame, keys, up to instructionsPerFrame
+// instructions with a stall ending the frame for that lane, timers, so a
+// lane comes out bit for bit the machine chip8_run_frame would make.
+// Trace events of the vector ops aren't recorded and the profiler doesn't
+// see them.
+
+#if defined(__AVX512BW__)
+#define CHIP8_LANE_WIDTH 64
+#elif defined(__AVX2__)
+#define CHIP8_LANE_WIDTH 32
+#else
+#define CHIP8_LANE_WIDTH 16
+#endif
+
+typedef u8  lane_u8  __attribute__((vector_size(CHIP8_LANE_WIDTH)));
+typedef i8  lane_i8  __attribute__((vector_size(CHIP8_LANE_WIDTH)));
+typedef u16 lane_u16 __attribute__((vector_size(CHIP8_LANE_WIDTH * 2)));
+typedef i16 lane_i16 __attribute__((vector_size(CHIP8_LANE_WIDTH * 2)));
+typedef u32 lane_u32 __attribute__((vector_size(CHIP8_LANE_WIDTH * 4)));
+typedef i32 lane_i32 __attribute__((vector_size(CHIP8_LANE_WIDTH * 4)));
+
+// lanes of A where M is all ones, B elsewhere
+#define LANE_SELECT(M, A, B) (((A) & (M)) | ((B) & ~(M)))
+
+typedef struct chip8_lane_block {
+    lane_u8  V[16];
+    lane_u16 I;
+    lane_u16 pc;
+    lane_u8  keypad[16]; // all ones where the key is down, as the frame set it
+    lane_u32 rngState;
+    lane_u8  delayTimer;
+    lane_u8  soundTimer;
+    lane_u8  present;   // all ones for lanes that are a machine
+    lane_u8  halted;    // all ones for lanes that stalled in the last frame
+    u32      scalarFrames; // frames left to run one lane at a time, see lanes_run_block
+} chip8_lane_block;
+
+// Lanes that stopped agreeing cost a vector step per lane, more than the
+// plain interpreter would. A block whose last frame shared too little runs
+// its lanes one at a time for the next CHIP8_LANE_SCALAR_FRAMES frames and
+// then tries again. The costs are vector steps and lanes run by the
+// handlers in interpreted instructions, roughly.
+#define CHIP8_LANE_SCALAR_FRAMES 64
+#define CHIP8_LANE_STEP_COST     6
+#define CHIP8_LANE_FALLBACK_COST 2
+
+typedef struct chip8_lanes {
+    chip8_lane_block* blocks;
+    chip8*            machines;   // one per lane, registers current after chip8_lanes_sync
+    u32               count;
+    u32               blockCount;
+    // code some lane wrote to since they were booted, empty when
+    // writtenLo >= writtenHi
+    u32               writtenLo;
+    u32               writtenHi;
+    u64               fallbacks;  // lane instructions run by the handlers
+} chip8_lanes;
+
+static inline u64
+lanes_bits(lane_u8 m) {
+#if defined(__AVX512BW__)
+    return _mm512_movepi8_mask((__m512i)m);
+#elif defined(__AVX2__)
+    return (u32)_mm256_movemask_epi8((__m256i)m);
+#elif defined(__SSE2__)
+    return (u32)_mm_movemask_epi8((__m128i)m);
+#else
+    u64 bits = 0;
+    for(u32 i = 0; i < CHIP8_LANE_WIDTH; i++) bits |= (u64)(m[i] >> 7) << i;
+    return bits;
+#endif
+}
+
+// 16 bit lanes equal to V as an all ones mask, and that as a byte lane
+// mask. Spelled out as arithmetic since gcc does compares of vectors wider
+// than a register one lane at a time.
+#define LANE_EQ16(A, V) (((((A) ^ (V)) | -((A) ^ (V))) >> 15) - 1)
+#define LANE_NARROW(M) ((lane_u8)__builtin_convertvector((lane_i16)(M), lane_i8))
+
+// v in every 16 bit lane. gcc also builds vectors wider than a register
+// from a scalar one lane at a time, so splat a register's worth and copy.
+static inline void
+lanes_splat16(lane_u16* out, u16 v) {
+    typedef u16 half_u16 __attribute__((vector_size(CHIP8_LANE_WIDTH)));
+    half_u16 half = (half_u16){0} + v;
+    memcpy(out, &half, sizeof(half));
+    memcpy((u8*)out + sizeof(half), &half, sizeof(half));
+}
+
+// a byte lane mask as a mask for the 16 and 32 bit lanes
+#define LANE_WIDEN16(M) ((lane_u16)__builtin_convertvector((lane_i8)(M), lane_i16))
+#define LANE_WIDEN32(M) ((lane_u32)__builtin_convertvector((lane_i8)(M), lane_i32))
+
+static void
+lanes_spill(const chip8_lane_block* b, u32 slot, chip8* c) {
+    for(u32 r = 0; r < 16; r++) c->VRegisters[r] = b->V[r][slot];
+    c->IReqister = b->I[slot];
+    c->pc = b->pc[slot];
+    c->rngState = b->rngState[slot];
+    c->delayTimer = b->delayTimer[slot];
+    c->soundTimer = b->soundTimer[slot];
+}
+
+static void
+lanes_fill(chip8_lane_block* b, u32 slot, const chip8* c) {
+    for(u32 r = 0; r < 16; r++) b->V[r][slot] = c->VRegisters[r];
+    b->I[slot] = c->IReqister;
+    b->pc[slot] = c->pc;
+    b->rngState[slot] = c->rngState;
+    b->delayTimer[slot] = c->delayTimer;
+    b->soundTimer[slot] = c->soundTimer;
+    for(u32 k = 0; k < 16; k++) b->keypad[k][slot] = c->keypad[k] ? 0xFF : 0;
+}
+
+// count lanes, all starting out as a copy of boot. Returns 0 if out of memory
+static i32
+chip8_lanes_create(chip8_lanes* L, const chip8* boot, u32 count) {
+
+    memset(L, 0, sizeof(*L));
+    L->count = count;
+    L->blockCount = (count + CHIP8_LANE_WIDTH - 1) / CHIP8_LANE_WIDTH;
+    L->blocks = aligned_alloc(_Alignof(chip8_lane_block), L->blockCount * sizeof(chip8_lane_block));
+    // the decode caches are most of a struct chip8 and only get touched
+    // where the handlers run, calloc leaves the rest unmapped
+    L->machines = calloc(count, sizeof(chip8));
+    if(!L->blocks || !L->machines) {
+        printf("failed to allocate %u lanes\n", count);
+        if(L->blocks) free(L->blocks);
+        if(L->machines) free(L->machines);
+        return 0;
+    }
+    memset(L->blocks, 0, L->blockCount * sizeof(chip8_lane_block));
+    for(u32 i = 0; i < count; i++) {
+        chip8* c = &L->machines[i];
+        memcpy(c, boot, CHIP8_STATE_SIZE);
+        chip8_lane_block* b = &L->blocks[i / CHIP8_LANE_WIDTH];
+        lanes_fill(b, i % CHIP8_LANE_WIDTH, c);
+        b->present[i % CHIP8_LANE_WIDTH] = 0xFF;
+    }
+    return 1;
+}
+
+static void
+chip8_lanes_dispose(chip8_lanes* L) {
+    free(L->blocks);
+    free(L->machines);
+}
+
+static void
+chip8_lanes_seed(chip8_lanes* L, u32 lane, u32 seed) {
+    chip8* c = &L->machines[lane];
+    chip8_seed(c, seed);
+    L->blocks[lane / CHIP8_LANE_WIDTH].rngState[lane % CHIP8_LANE_WIDTH] = c->rngState;
+}
+
+// Puts one lane back to a copy of boot (the machine the lanes were created
+// from) while the others keep going. Decodes of code any lane wrote to are
+// dropped on that lane, the rest of its cache still matches boot.
+static void
+chip8_lanes_reset(chip8_lanes* L, u32 lane, const chip8* boot) {
+    chip8* c = &L->machines[lane];
+    memcpy(c, boot, CHIP8_STATE_SIZE);
+    if(L->writtenLo < L->writtenHi) {
+        chip8_invalidate(c, L->writtenLo, L->writtenHi - L->writtenLo);
+    }
+    c->dirtyLo = c->dirtyHi = 0;
+    c->trap = chip8_trap_none;
+    chip8_lane_block* b = &L->blocks[lane / CHIP8_LANE_WIDTH];
+    lanes_fill(b, lane % CHIP8_LANE_WIDTH, c);
+    b->halted[lane % CHIP8_LANE_WIDTH] = 0;
+}
+
+// Brings every lane's struct chip8 up to date with its registers
+static void
+chip8_lanes_sync(chip8_lanes* L) {
+    for(u32 i = 0; i < L->count; i++) {
+        lanes_spill(&L->blocks[i / CHIP8_LANE_WIDTH], i % CHIP8_LANE_WIDTH, &L->machines[i]);
+    }
+}
+
+// Takes what a lane's handlers wrote into the written range
+static inline void
+lanes_merge_written(chip8_lanes* L, chip8* c) {
+    if(c->dirtyLo < c->dirtyHi) {
+        if(L->writtenLo >= L->writtenHi) {
+            L->writtenLo = c->dirtyLo;
+            L->writtenHi = c->dirtyHi;
+        } else {
+            if(c->dirtyLo < L->writtenLo) L->writtenLo = c->dirtyLo;
+            if(c->dirtyHi > L->writtenHi) L->writtenHi = c->dirtyHi;
+        }
+        c->dirtyLo = c->dirtyHi = 0;
+    }
+}
+
+// Runs the instruction at pc on the lanes in bits through the handlers,
+// returns on how many (trapped lanes don't run, like in chip8_run)
+static u32
+lanes_fallback(chip8_lanes* L, chip8_lane_block* b, u32 first, u64 bits) {
+
+    u32 ran = 0;
+    for(; bits; bits &= bits - 1) {
+        u32 slot = (u32)__builtin_ctzll(bits);
+        chip8* c = &L->machines[first + slot];
+        if(c->trap) continue; // stays on the instruction, stalled
+        lanes_spill(b, slot, c);
+        chip8_instr* in = &c->decoded[c->pc];
+        if(!in->handler) {
+            chip8_decode(c, c->pc, in);
+        }
+        in->handler(c, in);
+        lanes_fill(b, slot, c);
+        lanes_merge_written(L, c);
+        L->fallbacks += 1;
+        ran += 1;
+    }
+    return ran;
+}
+
+// One instruction on the lanes in m (all at pc, running code no lane
+// wrote to) as vector ops, 0 if it isn't one of those and needs the
+// handlers. in is decoded from the shared code, the opcode alone decides
+// the handler so it's switched on directly.
+static inline i32
+lanes_vector_op(chip8_lane_block* b, const chip8* code, const chip8_instr* in, lane_u8 m, u16 pc) {
+
+    u16 opcode = in->opcode;
+    u8 x = in->x, y = in->y;
+    lane_u8* V = b->V;
+    lane_u8 zero = {0};
+    lane_u8 one = zero + 1;
+    lane_u16 m16 = LANE_WIDEN16(m);
+    lane_u8 skip; // lanes that skip the next instruction
+
+    switch(opcode >> 12) {
+        case 0x1: {
+            lane_u16 target;
+            lanes_splat16(&target, in->nnn);
+            b->pc = LANE_SELECT(m16, target, b->pc);
+            return 1;
+        }
+        case 0x3: skip = (lane_u8)(V[x] == in->nn); goto skip;
+        case 0x4: skip = (lane_u8)(V[x] != in->nn); goto skip;
+        case 0x5:
+            if(in->n != 0) return 0;
+            skip = (lane_u8)(V[x] == V[y]);
+            goto skip;
+        case 0x9:
+            if(in->n != 0) return 0;
+            skip = (lane_u8)(V[x] != V[y]);
+            goto skip;
+        case 0xE:
+            if(in->nn != 0x9E && in->nn != 0xA1) return 0;
+            // a key past F traps, the handler does that
+            if(lanes_bits((lane_u8)(V[x] > 0xF) & m)) return 0;
+            skip = zero;
+            for(u8 k = 0; k < 16; k++) {
+                skip |= b->keypad[k] & (lane_u8)(V[x] == k);
+            }
+            if(in->nn == 0xA1) skip = ~skip;
+            goto skip;
+        case 0x6:
+            V[x] = LANE_SELECT(m, zero + in->nn, V[x]);
+            break;
+        case 0x7:
+            V[x] = LANE_SELECT(m, V[x] + in->nn, V[x]);
+            break;
+        case 0x8:
+            // same order as the handlers, so x or y being F comes out the same
+            switch(in->n) {
+                case 0x0: V[x] = LANE_SELECT(m, V[y], V[x]); break;
+                case 0x1: V[x] = LANE_SELECT(m, V[x] | V[y], V[x]); break;
+                case 0x2: V[x] = LANE_SELECT(m, V[x] & V[y], V[x]); break;
+                case 0x3: V[x] = LANE_SELECT(m, V[x] ^ V[y], V[x]); break;
+                case 0x4: {
+                    V[0xF] = LANE_SELECT(m, zero, V[0xF]);
+                    lane_u8 carry = (lane_u8)(V[y] > 0xFF - V[x]);
+                    V[0xF] = LANE_SELECT(m & carry, one, V[0xF]);
+                    V[x] = LANE_SELECT(m, V[x] + V[y], V[x]);
+                    break;
+                }
+                case 0x5: {
+                    V[0xF] = LANE_SELECT(m, one, V[0xF]);
+                    lane_u8 borrow = (lane_u8)(V[x] < V[y]);
+                    V[0xF] = LANE_SELECT(m & borrow, zero, V[0xF]);
+                    V[x] = LANE_SELECT(m, V[x] - V[y], V[x]);
+                    break;
+                }
+                case 0x6:
+                    V[0xF] = LANE_SELECT(m, V[x] & 1, V[0xF]);
+                    V[x] = LANE_SELECT(m, V[x] >> 1, V[x]);
+                    break;
+                case 0x7: {
+                    V[0xF] = LANE_SELECT(m, one, V[0xF]);
+                    lane_u8 borrow = (lane_u8)(V[y] < V[x]);
+                    V[0xF] = LANE_SELECT(m & borrow, zero, V[0xF]);
+                    V[x] = LANE_SELECT(m, V[y] - V[x], V[x]);
+                    break;
+                }
+                case 0xE:
+                    V[0xF] = LANE_SELECT(m, V[x] >> 7, V[0xF]);
+                    V[x] = LANE_SELECT(m, V[x] << 1, V[x]);
+                    break;
+                default:
+                    return 0;
+            }
+            break;
+        case 0xA: {
+            lane_u16 address;
+            lanes_splat16(&address, in->nnn);
+            b->I = LANE_SELECT(m16, address, b->I);
+            break;
+        }
+        case 0xC: {
+            lane_u32 m32 = LANE_WIDEN32(m);
+            lane_u32 r = b->rngState;
+            r ^= r << 13;
+            r ^= r >> 17;
+            r ^= r << 5;
+            b->rngState = LANE_SELECT(m32, r, b->rngState);
+            V[x] = LANE_SELECT(m, __builtin_convertvector(r, lane_u8) & in->nn, V[x]);
+            break;
+        }
+        case 0xF:
+            switch(in->nn) {
+                case 0x07: V[x] = LANE_SELECT(m, b->delayTimer, V[x]); break;
+                case 0x15: b->delayTimer = LANE_SELECT(m, V[x], b->delayTimer); break;
+                case 0x18: b->soundTimer = LANE_SELECT(m, V[x], b->soundTimer); break;
+                case 0x1E: {
+                    V[0xF] = LANE_SELECT(m, zero, V[0xF]);
+                    b->I = LANE_SELECT(m16, b->I + __builtin_convertvector(V[x], lane_u16), b->I);
+                    // I > 0xFFF, (I >> 12) + 15 has bit 4 set exactly when it's past
+                    lane_u16 past = -(((b->I >> 12) + 15) >> 4);
+                    lane_u8 over = LANE_NARROW(past);
+                    V[0xF] = LANE_SELECT(m & over, one, V[0xF]);
+                    break;
+                }
+                default:
+                    return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+    b->pc = LANE_SELECT(m16, b->pc + 2, b->pc);
+    return 1;
+
+skip:
+    {
+        // F000 NNNN after a skip is 4 bytes, like in chip8_skip_next
+        u16 next = pc + 2;
+        lane_u16 skip16 = LANE_WIDEN16(skip & m);
+        lane_u16 length = code->memory[next] == 0xF0 && code->memory[(u16)(next + 1)] == 0x00 ?
+            (lane_u16){0} + 4 : (lane_u16){0} + 2;
+        b->pc = LANE_SELECT(m16, b->pc + 2 + (skip16 & length), b->pc);
+    }
+    return 1;
+}
+
+// The frame for every lane of block b on its struct chip8, chip8_run_frame
+// with the keys already set
+static u64
+lanes_run_block_scalar(chip8_lanes* L, chip8_lane_block* b, u32 first, u32 instructionsPerFrame) {
+
+    u64 executed = 0;
+    for(u64 bits = lanes_bits(b->present); bits; bits &= bits - 1) {
+        u32 slot = (u32)__builtin_ctzll(bits);
+        chip8* c = &L->machines[first + slot];
+        lanes_spill(b, slot, c);
+        u32 ran = chip8_run(c, instructionsPerFrame);
+        chip8_tick_timers(c);
+        lanes_fill(b, slot, c);
+        lanes_merge_written(L, c);
+        b->halted[slot] = ran < instructionsPerFrame ? 0xFF : 0;
+        executed += ran;
+    }
+    return executed;
+}
+
+// Runs up to instructionsPerFrame instructions on every lane of block
+// number index, returns how many ran in total
+static u64
+lanes_run_block(chip8_lanes* L, u32 index, u32 instructionsPerFrame) {
+
+    chip8_lane_block* b = &L->blocks[index];
+    u32 first = index * CHIP8_LANE_WIDTH;
+    if(b->scalarFrames) {
+        b->scalarFrames -= 1;
+        return lanes_run_block_scalar(L, b, first, instructionsPerFrame);
+    }
+
+    chip8* code = &L->machines[0]; // decodes the code nobody wrote to
+    lane_u8 live = b->present;     // lanes that didn't stall yet
+    u64 executed = 0;
+    u64 fallbacks = L->fallbacks;
+    u64 steps = 0;
+
+    for(u32 step = 0; step < instructionsPerFrame && lanes_bits(live); step++) {
+        lane_u8 pending = live;
+        u64 pendingBits;
+        while((pendingBits = lanes_bits(pending)) != 0) {
+            u32 leader = (u32)__builtin_ctzll(pendingBits);
+            u16 pc = b->pc[leader];
+            lane_u16 pcs;
+            lanes_splat16(&pcs, pc);
+            lane_u8 m = pending & LANE_NARROW(LANE_EQ16(b->pc, pcs));
+            u64 bits = lanes_bits(m);
+
+            i32 shared = L->writtenLo >= L->writtenHi || (u32)pc + 4 <= L->writtenLo || pc >= L->writtenHi;
+            i32 done = 0;
+            if(shared) {
+                chip8_instr* in = &code->decoded[pc];
+                if(!in->handler) {
+                    chip8_decode(code, pc, in);
+                }
+                done = lanes_vector_op(b, code, in, m, pc);
+            }
+            if(done) {
+                executed += (u64)__builtin_popcountll(bits);
+            } else {
+                executed += lanes_fallback(L, b, first, bits);
+            }
+            steps += 1;
+
+            // a lane that didn't move stalled, it's done for this frame.
+            // Stalling on the frame's last instruction isn't halting, as
+            // for chip8_run that ran all of them
+            if(step + 1 < instructionsPerFrame) {
+                live &= ~(m & LANE_NARROW(LANE_EQ16(b->pc, pcs)));
+            }
+            pending &= ~m;
+        }
+    }
+
+    fallbacks = L->fallbacks - fallbacks;
+    if(CHIP8_LANE_STEP_COST * steps + CHIP8_LANE_FALLBACK_COST * fallbacks > executed) {
+        b->scalarFrames = CHIP8_LANE_SCALAR_FRAMES;
+    }
+    b->halted = b->present & ~live;
+    b->delayTimer += (lane_u8)(b->delayTimer != 0);
+    b->soundTimer += (lane_u8)(b->soundTimer != 0);
+    return executed;
+}
+
+// One frame on every lane, keys holds a keypad bitmask per lane (NULL for
+// none pressed). Returns the instructions run over all lanes.
+static u64
+chip8_lanes_frame(chip8_lanes* L, const u16* keys, u32 instructionsPerFrame) {
+
+    for(u32 i = 0; i < L->count; i++) {
+        u16 k = keys ? keys[i] : 0;
+        chip8_set_keys(&L->machines[i], k);
+        chip8_lane_block* b = &L->blocks[i / CHIP8_LANE_WIDTH];
+        for(u32 key = 0; key < 16; key++) b->keypad[key][i % CHIP8_LANE_WIDTH] = (k >> key) & 1 ? 0xFF : 0;
+    }
+    u64 executed = 0;
+    for(u32 i = 0; i < L->blockCount; i++) {
+        executed += lanes_run_block(L, i, instructionsPerFrame);
+    }
+    return executed;
+}
+
+#endif /* LOCKSTEP_H */
@@ -2,6 +2,7 @@
  * Check license.txt in project root for license information *
  *********************************************************** */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #define GL_GLEXT_PROTOTYPES
@@ -9,33 +10,40 @@
 #include <SDL2/SDL_opengl.h>
 #include <GL/gl.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "defs.h"
 #include "fileload.h"
-#include "cmath.h"
 
-u8 memory[4096];
-u8 VRegisters[16];
+#include "chip8.h"
+#include "triplebuffer.h"
+#include "scheduler.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "inputlog.h"
+#include "romlib.h"
+#include "audio.h"
+#include "keyqueue.h"
+
+chip8 machine;
+u16 keyState = 0;  // keypad as the machine has it, changes reach it through keyQueue once per tick
+chip8_key_queue keyQueue;
+u64 frameCount = 0; // ticks run since boot
+
+// -R, every keypad change is logged against the tick it was seen on
+chip8_input_log inputLog;
+i32 recordingInput = 0;
+
+// sound timer output, rendered per tick and played by the SDL audio callback
+chip8_audio sound;
+SDL_AudioDeviceID audioDevice = 0;
+
+// finished frames on their way from the emulation loop to the render thread
+triple_buffer frames;
+i32 presenting = 1;
 
-u16 IReqister;   //0x000 to 0xFFF
-u16 pc;          //0x000 to 0xFFF
-
-// 0x000-0x1FF - Chip 8 interpreter (contains font set in emu)
-// 0x050-0x0A0 - Used for the built in 4x5 pixel font set (0-F)
-// 0x200-0xFFF - Program ROM and work RAM
-#define CHIP8_WIDTH 64
-#define CHIP8_HEIGHT 32
-u8 canvas[CHIP8_WIDTH * CHIP8_HEIGHT];
-u8 delayTimer;
-u8 soundTimer;
-
-u16 stack[16];
-u8 stackpointer;
-u8 keyPressed;
-
-u8 keypad[16]; //hex based keypad 1 - F
 /*
    Keypad                   Keyboard
    +-+-+-+-+                +-+-+-+-+
@@ -49,494 +57,52 @@ u8 keypad[16]; //hex based keypad 1 - F
    +-+-+-+-+                +-+-+-+-+
    */
 const int width = CHIP8_WIDTH * 10, height = CHIP8_HEIGHT * 10;
-const u16 PC_START_LOC = 0x200;
-
-unsigned char chip8Fontset[] =
-{
-    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-};
-
-void
-chip8_init() {
-
-    pc = PC_START_LOC;
-
-    for(int i = 0; i < (int)SIZEOF_ARRAY(chip8Fontset); ++i)
-        memory[/*0x050 +*/  i] = chip8Fontset[i];
-}
-
-#define REQ_VALIDATION(R) do{if(R > 0xF){printf("reqister overflow\n"); exit(1);}} while(0)
-#define MEMADDR_VALIDATION(R) do{if(R > 4095){printf("memory overflow\n"); exit(1);}} while(0)
-#define KEY_VALIDATION(R) do{if(R > 0xF){printf("keypad overflow\n"); exit(1);}} while(0)
-#define FONT_VALIDATION(R) do{if(R >= 0xF){printf("font overflow\n"); exit(1);}} while(0)
-#define STACK_VALIDATION(R) do{if(R > 15){printf("stack overflow\n"); exit(1);}} while(0)
-
-void
-chip8_load_game(char* game) {
-
-    size_t size;
-    u8* data = load_binary_file(game, &size);
-
-    if(!data) {
-        printf("%s not found\n", game);
-        exit(EXIT_FAILURE);
-    }
-    if(size >= (SIZEOF_ARRAY(memory) - (int)PC_START_LOC)) {
-        printf("Too large file!\n");
-        exit(EXIT_FAILURE);
-    }
-    memcpy(memory + PC_START_LOC, data, size);
-
-    free(data);
-}
-
-u8 draw;
-
-void
-chip8_cycle() {
-
-    static int updated = 0;
-    u16 opcode = memory[pc] << 8 | memory[pc + 1];
-#if 0 // For debugging
-    printf ("Executing %04X at %04X , I:%02X SP:%02X UPDATE:%d V0: %d\n",
-           opcode, pc, IReqister, stackpointer, updated, (int)VRegisters[0]);
-#endif
-
-    if(++updated > 100 && 0) exit(1);
-    //printf ("next opcode: 0x%X\n", opcode);
-    //sleep(1);
-
-    switch(opcode & 0xF000) {
-        case 0x0000: // Jumps to address NNN
-            {
-                switch(opcode & 0x00FF) {
-                    case 0x0EE: // return from subroutine
-                        {
-                            stackpointer -= 1;
-                            STACK_VALIDATION(stackpointer);
-                            //printf("stackptr %d stack %d \n", stackpointer, stack[stackpointer]);
-                            pc = stack[stackpointer];
-                            pc += 2;
-                        } break;
-                    case 0x0E0: // display clear
-                        {
-                            memset(canvas,0 , sizeof(canvas));
-                            draw = 1;
-                            pc += 2;
-                        } break;
-                    default:
-                        printf ("Unknown sub opcode: 0x%X\n", opcode);
-                        exit(1);
-                        break;
-                }
-                //u16 jumpAddr = opcode & 0x0FFF;
-                //c = jumpAddr;
-
-            } break;
-        case 0x1000: // Jumps to address NNN
-            {
-                u16 jumpAddr = opcode & 0x0FFF;
-                MEMADDR_VALIDATION(jumpAddr);
-                pc = jumpAddr;
-            } break;
-        case 0x2000: // Calls subroutine at NNN
-            {
-                u16 addr = opcode & 0x0FFF;
-                MEMADDR_VALIDATION(addr);
-                stack[stackpointer] = pc;
-                stackpointer += 1;
-                STACK_VALIDATION(stackpointer);
-                pc = addr;
-            } break;
-        case 0x3000:    // Skips the next instruction if VX equals NN.
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                REQ_VALIDATION(Vreq);
-                u16 cond = opcode & 0x00FF;
-                if(VRegisters[Vreq] == cond) {
-                    pc += 2;
-                }
-                pc += 2;
-
-            } break;
-        case 0x4000: // Skips the next instruction if VX does not equals NN.
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                REQ_VALIDATION(Vreq);
-                u16 cond = opcode & 0x00FF;
-                if(VRegisters[Vreq] != cond) {
-                    pc += 2;
-                }
-                pc += 2;
-
-            } break;
-        case 0x5000: // Skips the next instruction if VX equals VY.
-            {
-                u8 VXreq = (opcode & 0x0F00) >> 8;
-                u8 VYreq = (opcode & 0x00F0) >> 4;
-                REQ_VALIDATION(VXreq);
-                REQ_VALIDATION(VYreq);
-                if(VRegisters[VXreq] == VRegisters[VYreq]) {
-                    pc += 2;
-                }
-                pc += 2;
-            } break;
-
-        case 0x6000: //Sets VX to NN.
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                REQ_VALIDATION(Vreq);
-                VRegisters[Vreq] = opcode & 0x00FF;
-                pc += 2;
-            } break;
-        case 0x7000: // Adds NN to VX. (Carry flag is not changed)
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                u8 val = opcode & 0x00FF;
-                REQ_VALIDATION(Vreq);
-                VRegisters[Vreq] += val;
-                pc += 2;
-            } break;
-        case 0x8000:
-            {
-                u8 subOpCode = (opcode & 0x000F);
-
-                u8 VXreq = (opcode & 0x0F00) >> 8;
-                u8 VYreq = (opcode & 0x00F0) >> 4;
-                REQ_VALIDATION(VXreq);
-                REQ_VALIDATION(VYreq);
-
-                switch(subOpCode) {
-                    case 0x0: // Sets VX to the value of VY.
-                        {
-                            VRegisters[VXreq] = VRegisters[VYreq];
-                        } break;
-                    case 0x1: // Bitwise OR operation
-                        {
-                            VRegisters[VXreq] = VRegisters[VXreq] | VRegisters[VYreq];
-                        } break;
-                    case 0x2: // Bitwise AND operation
-                        {
-                            VRegisters[VXreq] = VRegisters[VXreq] & VRegisters[VYreq];
-                        } break;
-                    case 0x3: // Sets VX to VX xor VY.
-                        {
-                            VRegisters[VXreq] ^= VRegisters[VYreq];
-                        } break;
-                    case 0x4: // Adds VY to VX. VF is set to 1 when there's a carry,
-                        // and to 0 when there isn't.
-                        {
-                            //VRegisters[VXreq] += VRegisters[VYreq];
-                            VRegisters[0xF] = 0;
-                            if(VRegisters[VYreq] > (0xFF - VRegisters[VXreq])) {
-                                // Overflow
-                                VRegisters[0xF] = 1;
-                            }
-                            VRegisters[VXreq] += VRegisters[VYreq];
-
-                        } break;
-                    case 5: // VY is subtracted from VX. VF is set to 0 when there's a borrow,
-                        // and 1 when there isn't.
-                        {
-                            VRegisters[0xF] = 1;
-                            if(VRegisters[VXreq] < VRegisters[VYreq]) {
-                                // Underflow
-                                VRegisters[0xF] = 0;
-                            }
-                            VRegisters[VXreq] -= VRegisters[VYreq];
-                        } break;
-                    case 6: // Stores the least significant bit of VX in VF
-                        // and then shifts VX to the right by 1
-                        {
-                            u8 lsb = VRegisters[VXreq] & 0x01;
-                            VRegisters[0xF] = lsb;
-                            VRegisters[VXreq] >>= 1;
-                            printf("sdadsadadas\n");
-                            //getchar();
-                        } break;
-                    case 7: // Sets VX to VY minus VX. VF is set to 0 when there's a borrow,
-                        // and 1 when there isn't
-                        {
-                            // v[0xF] = *vxptr < *vyptr ? 1 : 0; // Reverse of the other SUB TODO
-                            VRegisters[0xF] = 1;
-                            if((int)VRegisters[VYreq] < (int)VRegisters[VXreq]) {
-                                // Underflow;
-                                VRegisters[0xF] = 0;
-                            }
-                            VRegisters[VXreq] = VRegisters[VYreq] - VRegisters[VXreq];
-                            printf("DJSAKLDJALSKDJLAS\n");
-                            //getchar();
-                        } break;
-                    case 0x0E: // Stores the most significant bit of VX in VF
-                        // and then shifts VX to the left by 1
-                        {
-                            //u8 msb = VRegisters[VXreq] & 0x80;
-                            u8 msb = VRegisters[VXreq] >> 7;
-                            VRegisters[0xF] = msb;
-                            VRegisters[VXreq] <<= 1;
-                        } break;
-                    default:
-                        printf ("Unknown sub opcode: 0x%X\n", opcode);
-                        exit(1);
-                        break;
-                }
-                pc += 2;
-            } break;
-        case 0x9000: //Skips the next instruction if VX doesn't equal VY
-            {
-                u8 VXreq = (opcode & 0x0F00) >> 8;
-                u8 VYreq = (opcode & 0x00F0) >> 4;
-                REQ_VALIDATION(VXreq);
-                REQ_VALIDATION(VYreq);
-
-                if(VRegisters[VXreq] != VRegisters[VYreq]) {
-                    pc += 2;
-                }
-                pc += 2;
-            } break;
-        case 0xA000: // Sets I to the address NNN
-            {
-                u16 addr = (opcode & 0x0FFF);
-                MEMADDR_VALIDATION(addr);
-                IReqister = addr;
-                pc += 2;
-            } break;
-        case 0xB000: // Jumps to the address NNN plus V0
-            {
-                u16 addr = (opcode & 0x0FFF) + (u16)VRegisters[0];
-                MEMADDR_VALIDATION(addr);
-                pc = addr;
-            } break;
-        case 0xC000: // Sets VX to the result of a bitwise
-            // and operation on a random number (Typically: 0 to 255) and NN.
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                u8 NN = (opcode & 0x00FF);
-                REQ_VALIDATION(Vreq);
-
-                //V[(opcode & 0x0F00) >> 8] = (rand() % (0xFF + 1)) & (opcode & 0x00FF);
-                VRegisters[Vreq] =          (rand() % (0xFF + 1)) & NN;
-                pc += 2;
-            } break;
-        case 0xD000:
-            // Draws a sprite at coordinate (VX, VY)
-            // that has a width of 8 pixels and a height of N pixels.
-            // Each row of 8 pixels is read as bit-coded starting from memory location I;
-            // I value doesn’t change after the execution of this instruction.
-            // As described above,
-            // VF is set to 1 if any screen pixels are flipped from set to unset when the sprite is drawn,
-            // and to 0 if that doesn’t happen
-            {
-                draw = 1;
-                u8 VXreq = (opcode & 0x0F00) >> 8;
-                u8 VYreq = (opcode & 0x00F0) >> 4;
-                u8 N = (opcode & 0x000F);
-                REQ_VALIDATION(VXreq);
-                REQ_VALIDATION(VYreq);
-
-                u8 startX = VRegisters[VXreq];
-                u8 startY = VRegisters[VYreq];
-
-                //printf("startx %d, starty %d n %d\n", (int)startX, (int)startY, (int)N);
-                VRegisters[0xF] = 0;
-
-                for(u8 y = startY, i = 0; y < (startY + N); y++, i++) {
-                    u8 row = memory[IReqister + i];
-                    //printf("pixel! %d \n", row);
-                    for(u8 x = startX, i2 = 0; i2 < 8; x++, i2++) {
-
-                        if( (row & (0x80 >> i2)) != 0 ) { // check if sprite has pixel set
-                            if(canvas[y * CHIP8_WIDTH + x] == 1) { // bit already set
-                                VRegisters[0xF] = 1;
-                            }
-                            canvas[y * CHIP8_WIDTH + x] ^= 0x1;
-                            //printf("drawing to %d new value %d\n", y * CHIP8_WIDTH + x, canvas[y * CHIP8_WIDTH + x]);
-                        }
-                    }
-                }
-                pc += 2;
-            } break;
-        case 0xE000:
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                REQ_VALIDATION(Vreq);
-                u8 key = VRegisters[Vreq];
-                KEY_VALIDATION(key);
-                u8 keypadKey = keypad[key]; // 1 or 0
-                switch(opcode & 0x0FF) {
-                    case 0x09E: // Skips the next instruction if the key stored in VX is pressed
-                        {
-                            if(keypadKey) {
-                                pc += 2;
-                            }
-                        } break;
-                    case 0x0A1: // Skips the next instruction if the key stored in VX isn't pressed
-                        {
-                            if(!keypadKey) {
-                                pc += 2;
-                            }
-                        } break;
-                    default:
-                        printf ("Unknown sub opcode: 0x%X\n", opcode);
-                        exit(1);
-                        break;
-                }
-                pc += 2;
-            } break;
-        case 0xF000:
-            {
-                u8 Vreq = (opcode & 0x0F00) >> 8;
-                REQ_VALIDATION(Vreq);
-                switch(opcode & 0x00FF) {
-                    case 0x0007: // Sets VX to the value of the delay timer
-                        {
-                            VRegisters[Vreq] = delayTimer;
-                            pc += 2;
-                        } break;
-                    case 0x000A: // A key press is awaited, and then stored in VX.
-                        // (Blocking Operation. All instruction halted until next key event)
-                        {
-                            if(keyPressed == 0) {
-                                printf("waiting for next key event!\n");
-                                break;
-                            }
-                            pc += 2;
-                        } break;
-                    case 0x0015: // Sets the delay timer to VX.
-                        {
-                            delayTimer = VRegisters[Vreq];
-                            pc += 2;
-                        } break;
-                    case 0x0018: // Sets the sound timer to VX
-                        {
-                            soundTimer = VRegisters[Vreq];
-                            pc += 2;
-                        } break;
-                    case 0x001E: // Adds VX to I. VF is set to 1
-                        // when there is a range overflow (I+VX>0xFFF), and to 0 when there isn't.
-                        {
-                            VRegisters[0xF] = 0;
-                            IReqister += VRegisters[Vreq];
-                            if(IReqister > 0xFFF) { //12 bit wide in chip8
-                                //IReqister -= 0xFFF + 1; //(-1 rolls to 0)
-                                VRegisters[0xF] = 1;
-                            }
-                            pc += 2;
-                        } break;
-                    case 0x0029:
-                        // Sets I to the location of the sprite for the character in VX.
-                        // Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-                        {
-                            u8 font = VRegisters[Vreq];
-                            printf("font %d req %d\n",(int)font, Vreq);
-                            FONT_VALIDATION(font);
-                            IReqister = /*0x050 +*/  font * 5;
-                            pc += 2;
-                            //getchar();
-                        } break;
-                    case 0x0033: //  Stores the binary-coded decimal representation of VX,
-                        // with the most significant of three digits at the address in I,
-                        // the middle digit at I plus 1, and the least significant digit at I plus 2.
-                        // (In other words, take the decimal representation of VX,
-                        // place the hundreds digit in memory at location in I,
-                        // the tens digit at location I+1, and the ones digit at location I+2.)
-                        {
-
-                            MEMADDR_VALIDATION(IReqister + 2);
-                            //printf("**************  Ireq %d\n", IReqister);
-                            memory[IReqister]     = VRegisters[Vreq] / 100;
-                            memory[IReqister + 1] = (VRegisters[Vreq] / 10) % 10;
-                            memory[IReqister + 2] = VRegisters[Vreq] % 10;
-                            pc += 2;
-                        } break;
-
-                    case 0x0055: // Stores V0 to VX (including VX) in memory starting at address I.
-                        // The offset from I is increased by 1 for each value written,
-                        // but I itself is left unmodified
-                        {
-                            u8 x = (opcode & 0x0F00) >> 8;// VRegisters[Vreq];
-                            MEMADDR_VALIDATION(IReqister + x);
-                            //REQ_VALIDATION(x);
-                            for(u8 i = 0; i <= x; i++) {
-                                printf("i %d IR %d vreq %d\n",i, IReqister, Vreq);
-                                memory[IReqister + i] = VRegisters[i];
-                            }
-                            pc += 2;
-                        } break;
-                    case 0x0065: // Fills V0 to VX (including VX) with values from memory
-                        // starting at address I.
-                        // The offset from I is increased by 1 for each value written,
-                        // but I itself is left unmodified.[d]
-                        {
-                            u8 x = (opcode & 0x0F00) >> 8;// VRegisters[Vreq];
-                            //u8 x = VRegisters[Vreq];
-                            //printf("**************  x %d\n", x);
-                            //printf("**************  req %d\n", Vreq);
-                            //printf("**************  I req %d\n", IReqister);
-                            for(u8 i = 0; i <= x; i++) {
-                                REQ_VALIDATION(i);
-                                MEMADDR_VALIDATION(IReqister + i);
-                                VRegisters[i] =  memory[IReqister + i];
-                            }
-                            pc += 2;
-                        } break;
-                    default:
-                        printf ("Unknown sub opcode: 0x%X\n", opcode);
-                        exit(1);
-                        break;
-                }
-            } break;
-        default:
-            printf ("Unknown opcode: 0x%X\n", opcode);
-            exit(1);
-            break;
-    }
-
-    keyPressed = 0;
-}
 
 i32 running = 1;
+i32 fastForward = 0; // held down with tab
+i32 saveStateRequested = 0; // F5
+i32 loadStateRequested = 0; // F9
+i32 rewinding = 0; // held down with backspace
+i32 traceRequested = 0; // F12
+i32 romStep = 0; // page up/down, previous or next rom of the library
 
 #define KEYMAP(FN) \
     FN('1', 0x1)\
 FN('2', 0x2)\
 FN('3', 0x3)\
-FN('4', 0x4)\
-FN('q', 0x5)\
-FN('w', 0x6)\
-FN('e', 0x7)\
-FN('r', 0x8)\
-FN('a', 0x9)\
-FN('s', 0xA)\
-FN('d', 0xB)\
-FN('f', 0xC)\
-FN('z', 0xD)\
-FN('x', 0xE)\
-FN('c', 0xF)\
-FN('v', 0x10)
-
-//printf("pressed %c %s\n", KEY, event.type == SDL_KEYDOWN ? "down" : "up");
-
-#define KEY_BIND(KEY, CODE) \
-    case KEY: \
-keypad[CODE] = event.type == SDL_KEYDOWN; \
-keyPressed = event.type == SDL_KEYDOWN; \
-break;
+FN('4', 0xC)\
+FN('q', 0x4)\
+FN('w', 0x5)\
+FN('e', 0x6)\
+FN('r', 0xD)\
+FN('a', 0x7)\
+FN('s', 0x8)\
+FN('d', 0x9)\
+FN('f', 0xE)\
+FN('z', 0xA)\
+FN('x', 0x0)\
+FN('c', 0xB)\
+FN('v', 0xF)
+
+// Host key to keypad key + 1 (0 is unbound), indexed by the key symbol
+// which is plain ASCII for the keys that can be bound. Rebuilt from the
+// rom's own keymap whenever a rom is booted.
+u8 keyBindings[128];
+
+#define KEY_DEFAULT(KEY, CODE) keyBindings[KEY] = CODE + 1;
+
+// keymap holds the host key for every keypad key, NULL for the default
+void
+keymap_apply(const u8* keymap) {
+    memset(keyBindings, 0, sizeof(keyBindings));
+    if(!keymap) {
+        KEYMAP(KEY_DEFAULT);
+        return;
+    }
+    for(u32 i = 0; i < 16; i++) {
+        if(keymap[i] < SIZEOF_ARRAY(keyBindings)) keyBindings[keymap[i]] = (u8)(i + 1);
+    }
+}
 
 void
 update_keypad() {
@@ -545,11 +111,43 @@ update_keypad() {
         if(event.key.repeat == 1) {
             continue;
         }
+        if((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) &&
+                event.key.keysym.sym >= 0 && event.key.keysym.sym < (i32)SIZEOF_ARRAY(keyBindings) &&
+                keyBindings[event.key.keysym.sym]) {
+            // SDL stamps events in SDL_GetTicks() milliseconds, take it
+            // over to the scheduler clock
+            u64 now = sched_now();
+            u32 age = SDL_GetTicks() - event.key.timestamp;
+            u64 time = age < 1000 ? now - age * 1000000ull : now;
+            chip8_key_queue_push(&keyQueue, time, (u8)(keyBindings[event.key.keysym.sym] - 1),
+                    event.type == SDL_KEYDOWN);
+            continue;
+        }
         switch (event.key.keysym.sym) {
-            KEYMAP(KEY_BIND);
             case SDLK_ESCAPE:
             running = 0;
             break;
+            case SDLK_TAB:
+            fastForward = event.type == SDL_KEYDOWN;
+            break;
+            case SDLK_BACKSPACE:
+            rewinding = event.type == SDL_KEYDOWN;
+            break;
+            case SDLK_F12:
+            traceRequested |= event.type == SDL_KEYDOWN;
+            break;
+            case SDLK_F5:
+            saveStateRequested |= event.type == SDL_KEYDOWN;
+            break;
+            case SDLK_F9:
+            loadStateRequested |= event.type == SDL_KEYDOWN;
+            break;
+            case SDLK_PAGEUP:
+            if(event.type == SDL_KEYDOWN) romStep = -1;
+            break;
+            case SDLK_PAGEDOWN:
+            if(event.type == SDL_KEYDOWN) romStep = 1;
+            break;
             default:
             break;
         }
@@ -614,95 +212,201 @@ shader_compile(GLenum type, const char* source) {
 
 
 
+// vertShaderSource and fragShaderSource, generated from vert.sha and
+// frag.sha by build.sh
+#include "shaders.h"
+
 u32 shaderProgram;
 u32 vao;
-i32 transformLoc;
-i32 projectionLoc;
-mat4 projection;
+u32 canvasTexture;
+
+// Last frame that was sent to the texture. Rows are compared against it
+// so an unchanged frame costs nothing and a partial one only sends the
+// span of rows that differ.
+chip8_frame uploaded;
+
+// Linked programs are cached in the user's pref dir, keyed by a hash of
+// the driver strings and the shader sources. Any change to either, or a
+// driver refusing the binary, falls back to compiling from source.
+#define PROGRAM_CACHE_MAGIC 0x47503843u // "C8PG"
+
+typedef struct program_cache_header {
+    u32 magic;
+    u32 format;
+    u64 key;
+    u32 length;
+    u32 reserved;
+} program_cache_header;
+
+u64
+program_cache_key() {
+    const char* parts[] = {
+        (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER),
+        (const char*)glGetString(GL_VERSION),
+        vertShaderSource,
+        fragShaderSource,
+    };
+    u64 hash = 0xcbf29ce484222325ull;
+    for(u32 i = 0; i < SIZEOF_ARRAY(parts); i++) {
+        for(const char* c = parts[i] ? parts[i] : ""; ; c++) {
+            hash ^= (u8)*c;
+            hash *= 0x100000001b3ull;
+            if(!*c) break;
+        }
+    }
+    return hash;
+}
 
-void
-renderer_init() {
+i32
+program_cache_path(char* path, size_t size) {
+    char* dir = SDL_GetPrefPath("chip8-emu", "chip8");
+    if(!dir) return 0;
+    snprintf(path, size, "%sprogram.bin", dir);
+    SDL_free(dir);
+    return 1;
+}
+
+i32
+program_cache_supported() {
+    if(!SDL_GL_ExtensionSupported("GL_ARB_get_program_binary")) return 0;
+    i32 formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return glGetError() == GL_NO_ERROR && formats > 0;
+}
 
+// returns 0 when there is no usable binary, program is untouched then
+i32
+program_cache_load(u32 program, u64 key) {
+
+    char path[1024];
+    if(!program_cache_path(path, sizeof(path))) return 0;
     size_t size = 0;
-    char* vs = load_file("vert.sha", &size);
-    if(!vs) {
-        printf("failed to load vert.sha\n");
-        exit(EXIT_FAILURE);
+    u8* data = load_binary_file(path, &size);
+    if(!data) return 0;
+
+    const program_cache_header* header = (const program_cache_header*)data;
+    i32 linked = 0;
+    if(size >= sizeof(*header) && header->magic == PROGRAM_CACHE_MAGIC &&
+            header->key == key && header->length == size - sizeof(*header)) {
+        glProgramBinary(program, header->format, data + sizeof(*header), (i32)header->length);
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        // a rejected binary is an error to GL but just a cache miss to us
+        while(glGetError() != GL_NO_ERROR);
     }
-    printf("%s\n", vs);
-
-    GLuint vert = shader_compile(GL_VERTEX_SHADER, vs);
-    free(vs);
+    free(data);
+    return linked;
+}
 
-    char* fs = load_file("frag.sha", &size);
-    if(!fs) {
-        printf("failed to load vert.sha\n");
-        exit(EXIT_FAILURE);
+void
+program_cache_store(u32 program, u64 key) {
+
+    i32 length = 0;
+    GLCHECK(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length));
+    if(length <= 0) return;
+    u8* data = malloc(sizeof(program_cache_header) + (size_t)length);
+    assert(data);
+    program_cache_header* header = (program_cache_header*)data;
+    memset(header, 0, sizeof(*header));
+    header->magic = PROGRAM_CACHE_MAGIC;
+    header->key = key;
+    GLCHECK(glGetProgramBinary(program, length, &length, &header->format, data + sizeof(*header)));
+    header->length = (u32)length;
+
+    char path[1024];
+    FILE* fp = program_cache_path(path, sizeof(path)) ? fopen(path, "wb") : NULL;
+    if(fp) {
+        fwrite(data, sizeof(*header) + (size_t)length, 1, fp);
+        fclose(fp);
     }
-    printf("%s\n", fs);
+    free(data);
+}
 
-    GLuint frag = shader_compile(GL_FRAGMENT_SHADER, fs);
-    free(fs);
-    shaderProgram = glCreateProgram();
+// compiles and links the embedded shaders into program
+void
+program_link(u32 program, i32 retrievable) {
+
+    GLuint vert = shader_compile(GL_VERTEX_SHADER, vertShaderSource);
+    GLuint frag = shader_compile(GL_FRAGMENT_SHADER, fragShaderSource);
 
-    GLCHECK(glAttachShader(shaderProgram, vert));
-    GLCHECK(glAttachShader(shaderProgram, frag));
+    GLCHECK(glAttachShader(program, vert));
+    GLCHECK(glAttachShader(program, frag));
 
-    GLCHECK(glBindAttribLocation(shaderProgram, 0, "vertexPosition"));
-    GLCHECK(glLinkProgram(shaderProgram));
+    GLCHECK(glBindAttribLocation(program, 0, "vertexPosition"));
+    if(retrievable) {
+        GLCHECK(glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+    }
+    GLCHECK(glLinkProgram(program));
 
     i32 linked;
-    GLCHECK(glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linked));
+    GLCHECK(glGetProgramiv(program, GL_LINK_STATUS, &linked));
 
     if (!linked)
     {
         i32 infoLen = 0;
-        GLCHECK(glGetProgramiv(shaderProgram, GL_INFO_LOG_LENGTH, &infoLen));
+        GLCHECK(glGetProgramiv(program, GL_INFO_LOG_LENGTH, &infoLen));
 
         if (infoLen > 1)
         {
             char* infoLog = (char*)malloc(sizeof(char) * infoLen);
-            GLCHECK(glGetProgramInfoLog(shaderProgram, infoLen, NULL, infoLog));
+            GLCHECK(glGetProgramInfoLog(program, infoLen, NULL, infoLog));
             printf("Error linking program:\n%s\n", infoLog);
             free(infoLog);
         }
-        glDeleteProgram(shaderProgram);
+        glDeleteProgram(program);
         exit(1);
     }
 
-    transformLoc = glGetUniformLocation(shaderProgram, "transform");
-    if(transformLoc == -1) {
-        printf("didnt find transform location\n");
-        exit(1);
+    GLCHECK(glDetachShader(program, vert));
+    GLCHECK(glDetachShader(program, frag));
+    GLCHECK(glDeleteShader(vert));
+    GLCHECK(glDeleteShader(frag));
+}
+
+void
+renderer_init() {
+
+    i32 cached = 0;
+    i32 useCache = program_cache_supported();
+    u64 key = useCache ? program_cache_key() : 0;
+
+    shaderProgram = glCreateProgram();
+    if(useCache) {
+        cached = program_cache_load(shaderProgram, key);
+        if(!cached) {
+            // the failed binary may have left the program in any state
+            glDeleteProgram(shaderProgram);
+            shaderProgram = glCreateProgram();
+        }
+    }
+    if(!cached) {
+        program_link(shaderProgram, useCache);
+        if(useCache) program_cache_store(shaderProgram, key);
     }
 
-    projectionLoc = glGetUniformLocation(shaderProgram, "projection");
-    if(projectionLoc == -1) {
-        printf("didnt find projection location\n");
+    i32 canvasLoc = glGetUniformLocation(shaderProgram, "canvas");
+    if(canvasLoc == -1) {
+        printf("didnt find canvas location\n");
         exit(1);
     }
 
-    GLCHECK(glDeleteShader(vert));
-    GLCHECK(glDeleteShader(frag));
-
+    // one quad over the whole viewport, the texture does the rest
     static const float vertData[] = {
-        -0.5f,  0.5f,
-        0.5f, -0.5f,
-        -0.5f, -0.5f,
+        -1.f,  1.f,
+        1.f, -1.f,
+        -1.f, -1.f,
 
-        -0.5f,  0.5f,
-        0.5f, -0.5f,
-        0.5f,  0.5f,
+        -1.f,  1.f,
+        1.f, -1.f,
+        1.f,  1.f,
     };
 
-
     GLCHECK(glGenVertexArrays(1, &vao));
 
     u32 vertbuff;
     GLCHECK(glGenBuffers(1, &vertbuff));
 
     GLCHECK(glBindBuffer(GL_ARRAY_BUFFER, vertbuff));
-    //u32 ssss = sizeof(vertData);
     GLCHECK(glBufferData(GL_ARRAY_BUFFER, sizeof(vertData), vertData, GL_STATIC_DRAW));
 
     GLCHECK(glBindVertexArray(vao));
@@ -713,59 +417,338 @@ renderer_init() {
 
     GLCHECK(glBindVertexArray(0));
 
-    GLCHECK(glEnable(GL_DEPTH_TEST));
-    GLCHECK(glDepthMask(GL_FALSE));
+    // One byte per pixel, the colour index (plane bits) times 85, row 0 is
+    // the top of the screen. Always hires, lores pixels are sent as 2x2.
+    static const u8 blank[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+    GLCHECK(glGenTextures(1, &canvasTexture));
+    GLCHECK(glActiveTexture(GL_TEXTURE0));
+    GLCHECK(glBindTexture(GL_TEXTURE_2D, canvasTexture));
+    GLCHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+    GLCHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT, 0,
+                GL_RED, GL_UNSIGNED_BYTE, blank));
+    GLCHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GLCHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GLCHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GLCHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    memset(&uploaded, 0, sizeof(uploaded));
 
-    //orthomat(&projection, 0.5f, (float)CHIP8_WIDTH + 0.5f, (float)CHIP8_HEIGHT + 0.5f, 0.5f, 0.1f, 100.f);
-    //orthomat(&projection, 0, (float)CHIP8_WIDTH, 0, (float)CHIP8_HEIGHT, 0.1f, 100.f);
+    GLCHECK(glUseProgram(shaderProgram));
+    GLCHECK(glUniform1i(canvasLoc, 0));
 
-    orthomat(&projection, 0.5f, // left
-            (float)CHIP8_WIDTH + 0.5f , // right
-            (float)CHIP8_HEIGHT  + 0.5f  - 1.f, // bottom
-            /* 0.5f */ -0.5f,
-            0.1f, 100.f);
+    GLCHECK(glDisable(GL_DEPTH_TEST));
 }
 
+static inline i32
+frame_row_equal(const chip8_frame* a, const chip8_frame* b, u32 y) {
+    for(u32 p = 0; p < CHIP8_PLANES; p++) {
+        if(a->canvas[p][0][y] != b->canvas[p][0][y] || a->canvas[p][1][y] != b->canvas[p][1][y]) return 0;
+    }
+    return 1;
+}
 
+// Sends the rows that changed since the last upload, as one span from the
+// first to the last dirty row.
+void
+renderer_upload_canvas(const chip8_frame* frame) {
+
+    u32 height = frame->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    u32 width = frame->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    i32 first = -1, last = -1;
+    for(u32 y = 0; y < height; y++) {
+        if(frame->hires != uploaded.hires || !frame_row_equal(frame, &uploaded, y)) {
+            if(first < 0) first = (i32)y;
+            last = (i32)y;
+        }
+    }
+    if(first < 0) return;
+
+    u32 scale = frame->hires ? 1 : 2;
+    u8 pixels[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+    for(i32 y = first; y <= last; y++) {
+        u8* out = &pixels[(u32)(y - first) * scale * CHIP8_HIRES_WIDTH];
+        for(u32 x = 0; x < width; x++) {
+            u32 col = x >> 6, bit = 63 - (x & 63);
+            u32 index = 0;
+            for(u32 p = 0; p < CHIP8_PLANES; p++) {
+                index |= (u32)((frame->canvas[p][col][y] >> bit) & 1) << p;
+            }
+            for(u32 i = 0; i < scale; i++) out[x * scale + i] = (u8)(index * 85);
+        }
+        if(scale == 2) memcpy(out + CHIP8_HIRES_WIDTH, out, CHIP8_HIRES_WIDTH);
+    }
+    memcpy(&uploaded, frame, sizeof(uploaded));
+    GLCHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first * scale, CHIP8_HIRES_WIDTH, (last - first + 1) * scale,
+                GL_RED, GL_UNSIGNED_BYTE, pixels));
+}
 
 void
-chip8_draw(SDL_Window *window) {
+chip8_draw(SDL_Window *window, const chip8_frame* frame) {
 
-    //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    renderer_upload_canvas(frame);
 
     glViewport(0, 0, width, height);
-    glClearColor(1.f, 0.f, 1.f, 0.f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDisable(GL_DEPTH_TEST);
-    // Draw all
-    GLCHECK(glUseProgram(shaderProgram));
-    GLCHECK(glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, (float*)&projection));
-    mat4 transform;
-    for(int y = 0; y < CHIP8_HEIGHT; y++) {
-        for(int x = 0; x < CHIP8_WIDTH; x++) {
-            //if((x + y) % 2) {
-            //    canvas[y * CHIP8_WIDTH + x] = 1;
-            //}
-            if(canvas[y * CHIP8_WIDTH + x] == 1) { // draw
-                create_translation_mat_inside(&transform, (vec3){x,y,0});
-                GLCHECK(glUniformMatrix4fv(transformLoc, 1, GL_FALSE, (float*)&transform));
-
-                glBindVertexArray(vao);
-                glDrawArrays(GL_TRIANGLES, 0, 6);
-            }
+    glClear(GL_COLOR_BUFFER_BIT);
+    GLCHECK(glBindVertexArray(vao));
+    GLCHECK(glDrawArrays(GL_TRIANGLES, 0, 6));
+
+    SDL_GL_SwapWindow(window);
+}
+
+// press to pixel times as the render thread saw them, reported on exit
+typedef struct latency_stats {
+    u64 count;
+    u64 total;
+    u64 min;
+    u64 max;
+} latency_stats;
+
+latency_stats inputLatency = { 0, 0, ~0ull, 0 };
+
+void
+latency_stats_add(latency_stats* stats, u64 ns) {
+    stats->count += 1;
+    stats->total += ns;
+    if(ns < stats->min) stats->min = ns;
+    if(ns > stats->max) stats->max = ns;
+}
+
+typedef struct render_context {
+    SDL_Window*   window;
+    SDL_GLContext context;
+} render_context;
+
+// Owns the GL context. Presents the newest published frame, so a blocking
+// vsync swap only ever holds up this thread and never the emulation.
+int
+render_thread(void* arg) {
+
+    render_context* rc = arg;
+    if(SDL_GL_MakeCurrent(rc->window, rc->context) != 0) {
+        printf("failed to bind gl context: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    SDL_GL_SetSwapInterval(1);
+    renderer_init();
+
+    while(__atomic_load_n(&presenting, __ATOMIC_ACQUIRE)) {
+        if(!tb_acquire(&frames)) {
+            // nothing new, the last swap is still on screen
+            SDL_Delay(1);
+            continue;
+        }
+        const chip8_frame* frame = tb_front(&frames);
+        chip8_draw(rc->window, frame);
+        if(frame->inputTime) {
+            latency_stats_add(&inputLatency, sched_now() - frame->inputTime);
         }
     }
+    SDL_GL_MakeCurrent(rc->window, NULL);
+    return 0;
+}
 
+// emulated throughput since start, shown in the window title once a second
+typedef struct speed_stats {
+    u64 start;
+    u64 instructions;
+    u64 ticks;
+} speed_stats;
 
-    SDL_GL_SwapWindow(window);
+void
+speed_stats_reset(speed_stats* stats, u64 now) {
+    stats->start = now;
+    stats->instructions = 0;
+    stats->ticks = 0;
+}
+
+const char*
+path_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Boots a fresh machine on game with the settings in entry, which is its
+// library entry or one filled in from the command line. Returns the
+// instructions per frame to run it at, 0 if the rom didn't load (the
+// running machine is left alone then).
+u32
+boot_game(const char* game, const chip8_rom_entry* entry, u32 seed, u32 instructionsPerFrame) {
+
+    static chip8 next;
+    chip8_init(&next);
+    u64 hash;
+    if(!chip8_load_rom_file(&next, game, &hash)) {
+        return 0;
+    }
+    if(entry->hash && entry->hash != hash) {
+        printf("%s changed since the library was indexed\n", game);
+    }
+    chip8_seed(&next, seed);
+    next.quirks = entry->quirks;
+    next.draw = 1;
+#ifdef CHIP8_PROFILE
+    next.profile = machine.profile;
+#endif
+    machine = next;
+    keymap_apply(entry->hasKeymap ? entry->keymap : NULL);
+    return entry->instructionsPerFrame ? entry->instructionsPerFrame : instructionsPerFrame;
+}
+
+// Press to pixel. A key press is answered by the first tick after it that
+// draws, that frame carries the time of the press to the render thread
+// which measures up to its swap.
+u64 pendingPress = 0;  // pressed, nothing drawn since
+u64 answeredPress = 0; // drawn, waiting to be published
+
+// one frame of the machine, see inputlog.h
+u32
+run_tick(u32 instructionsPerFrame) {
+    u64 pressTime = 0;
+    keyState = chip8_key_queue_tick(&keyQueue, keyState, &pressTime);
+    if(pressTime && !pendingPress) pendingPress = pressTime;
+    if(recordingInput) {
+        chip8_input_log_record(&inputLog, (u32)frameCount, keyState);
+    }
+    frameCount += 1;
+
+    u8 drew = machine.draw;
+    machine.draw = 0;
+    u32 ran = chip8_run_frame(&machine, keyState, instructionsPerFrame);
+    if(machine.trap) {
+        chip8_trap_report(&machine);
+        exit(1);
+    }
+    if(machine.draw && pendingPress) {
+        if(!answeredPress) answeredPress = pendingPress;
+        pendingPress = 0;
+    }
+    machine.draw |= drew;
+
+    if(audioDevice) {
+        chip8_audio_tick(&sound, &machine);
+    }
+    return ran;
+}
+
+void
+audio_callback(void* userdata, Uint8* stream, int length) {
+    chip8_audio_pull(userdata, (float*)stream, (u32)length / sizeof(float));
+}
+
+// Opens the default device for mono float at sampleRate with a buffer of
+// bufferSamples, fed from sound. Without a device (or SDL_AUDIODRIVER
+// naming one that isn't there) the emulator just runs silent.
+void
+audio_open(u32 sampleRate, u32 bufferSamples, double tickRate) {
+
+    if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        printf("no audio: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_AudioSpec want, have;
+    memset(&want, 0, sizeof(want));
+    want.freq = (int)sampleRate;
+    want.format = AUDIO_F32SYS;
+    want.channels = 1;
+    want.samples = (Uint16)bufferSamples;
+    want.callback = audio_callback;
+    want.userdata = &sound;
+    // no allowed changes, SDL converts to whatever the device really does
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if(!audioDevice) {
+        printf("no audio: %s\n", SDL_GetError());
+        return;
+    }
+    chip8_audio_init(&sound, sampleRate, tickRate, have.samples);
+    printf("audio on %s, %u samples at %u Hz (%.1fms)\n", SDL_GetCurrentAudioDriver(),
+            (u32)have.samples, sampleRate, have.samples * 1000.0 / sampleRate);
+    SDL_PauseAudioDevice(audioDevice, 0);
+}
+
+void
+audio_close() {
+    if(!audioDevice) return;
+    SDL_CloseAudioDevice(audioDevice);
+    audioDevice = 0;
+    printf("audio: %" PRIu64 " samples of underrun, %" PRIu64 " dropped\n",
+            sound.underruns, sound.dropped);
+    chip8_audio_dispose(&sound);
 }
 
 int
 main(int argc, char** argv) {
 
-    if(argc != 2) {
+    // The core runs in ticks. Every tick samples input once, runs
+    // instructionsPerFrame instructions back to back and decrements the
+    // timers. Ticks and display refreshes each run on their own deadline.
+    u32 instructionsPerFrame = 10;
+    double tickRate = 60.0;    // Hz, timers and input
+    double displayRate = 60.0; // Hz
+    i32 uncapped = 0;          // run ticks back to back, no pacing
+    u32 fastForwardSpeed = 10; // multiplier while tab is held, 0 is flat out
+    const char* resumeState = NULL;
+    const char* inputLogPath = NULL;
+    i32 deterministic = 0;     // fixed seed instead of the time
+    u32 seed = 0;
+    const char* libraryDir = NULL;
+    // -f, -q and -k, for this run or stored with the rom in library mode
+    chip8_rom_entry settings;
+    memset(&settings, 0, sizeof(settings));
+    u32 explicitSettings = 0; // CHIP8_ROM_SET_* given
+    // -a, device buffer in samples (a power of two), 0 turns sound off
+    u32 audioBuffer = 256;
+    u32 audioRate = 48000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:t:d:us:l:D:R:L:q:k:a:h")) != -1) {
+        switch(opt) {
+            case 'f':
+                instructionsPerFrame = (u32)strtoul(optarg, NULL, 10);
+                settings.instructionsPerFrame = instructionsPerFrame;
+                explicitSettings |= CHIP8_ROM_SET_INSTRUCTIONS;
+                break;
+            case 'q':
+                settings.quirks = (u8)strtoul(optarg, NULL, 0);
+                explicitSettings |= CHIP8_ROM_SET_QUIRKS;
+                break;
+            case 'k':
+                if(strlen(optarg) != 16) {
+                    printf("-k takes 16 keys, the ones for keypad 0 to F\n");
+                    return EXIT_FAILURE;
+                }
+                for(u32 i = 0; i < 16; i++) settings.keymap[i] = (u8)tolower((u8)optarg[i]);
+                settings.hasKeymap = 1;
+                explicitSettings |= CHIP8_ROM_SET_KEYMAP;
+                break;
+            case 'L': libraryDir = optarg; break;
+            case 't': tickRate = strtod(optarg, NULL); break;
+            case 'd': displayRate = strtod(optarg, NULL); break;
+            case 'u': uncapped = 1; break;
+            case 's': fastForwardSpeed = (u32)strtoul(optarg, NULL, 10); break;
+            case 'l': resumeState = optarg; break;
+            case 'D': deterministic = 1; seed = (u32)strtoul(optarg, NULL, 0); break;
+            case 'R': inputLogPath = optarg; break;
+            case 'a': audioBuffer = (u32)strtoul(optarg, NULL, 10); break;
+            default:
+                printf("usage: %s [-f instructions per frame] [-t tick hz] [-d display hz] [-u]\n"
+                       "          [-s fast forward speed] [-l state] [-D seed] [-R input log]\n"
+                       "          [-L library dir] [-q quirks] [-k keymap] [-a audio buffer] [game]\n", argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(instructionsPerFrame == 0 || tickRate <= 0 || displayRate <= 0) {
+        printf("instructions per frame and rates must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if(optind >= argc && !libraryDir) {
         printf("specify game\n");
-        //return EXIT_FAILURE;
+    }
+    if(inputLogPath && resumeState) {
+        printf("input logs start from boot, can't combine -R with -l\n");
+        return EXIT_FAILURE;
+    }
+    if(audioBuffer & (audioBuffer - 1) || audioBuffer > 32768) {
+        printf("the audio buffer is a power of two up to 32768 samples, or 0 for no sound\n");
+        return EXIT_FAILURE;
     }
 
     SDL_Init( SDL_INIT_VIDEO );
@@ -789,58 +772,244 @@ main(int argc, char** argv) {
             width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
 
     assert(window);
-    SDL_GLContext Context = SDL_GL_CreateContext(window);
+    render_context rc = { window, SDL_GL_CreateContext(window) };
+    if(!rc.context) {
+        printf("failed to create gl context: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    // hand the context over to the render thread
+    SDL_GL_MakeCurrent(window, NULL);
+    tb_init(&frames);
+    SDL_Thread* renderer = SDL_CreateThread(render_thread, "render", &rc);
+    if(!renderer) {
+        printf("failed to create render thread: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
 
-    renderer_init();
+    if(audioBuffer) {
+        audio_open(audioRate, audioBuffer, tickRate);
+    }
 
     running = 1;
-    // Init rand
-    time_t t;
-    //srand((unsigned) time(&t));
-
-    chip8_init();
 
-    if(argc != 2) {
-        chip8_load_game("c8games/PONG");
+    // -L, the game names a rom in the library (the first one if left out)
+    // and the command line settings are stored with it for next time
+    chip8_romlib library;
+    u32 romIndex = 0;
+    char game[1024];
+    const chip8_rom_entry* entry = &settings;
+    if(libraryDir) {
+        if(!chip8_romlib_open(&library, libraryDir)) {
+            exit(EXIT_FAILURE);
+        }
+        if(library.count == 0) {
+            printf("no roms in %s\n", libraryDir);
+            exit(EXIT_FAILURE);
+        }
+        i32 found = optind >= argc ? 0 : chip8_romlib_find(&library, argv[optind]);
+        if(found < 0) {
+            printf("%s is not in %s\n", argv[optind], libraryDir);
+            exit(EXIT_FAILURE);
+        }
+        romIndex = (u32)found;
+        if(explicitSettings && !chip8_romlib_update(&library, romIndex, &settings, explicitSettings)) {
+            exit(EXIT_FAILURE);
+        }
+        entry = &library.entries[romIndex];
+        chip8_romlib_path(&library, romIndex, game, sizeof(game));
     } else {
-        chip8_load_game(argv[1]);
+        snprintf(game, sizeof(game), "%s", optind >= argc ? "c8games/PONG" : argv[optind]);
     }
-    double processorHZ = 1.0 / 100.0;
-    double timerHZ = 1.0 / 100.0;
-    double processorLastTime = (double)clock() / CLOCKS_PER_SEC;
-    double timerLastTime = processorLastTime;
-    while (running) {
-        double currentTime = (double)clock() / CLOCKS_PER_SEC;
-        //printf("%f\n", currentTime - processorLastTime);
 
-        if( (currentTime - processorLastTime) > processorHZ) {
+    if(!deterministic) seed = (u32)time(NULL);
+    u32 defaultInstructionsPerFrame = instructionsPerFrame;
+    instructionsPerFrame = boot_game(game, entry, seed, defaultInstructionsPerFrame);
+    if(!instructionsPerFrame) {
+        exit(EXIT_FAILURE);
+    }
+    if(inputLogPath) {
+        chip8_input_log_init(&inputLog, seed, instructionsPerFrame, machine.quirks);
+        chip8_input_log_setup(&inputLog, &machine);
+        recordingInput = 1;
+    }
+    if(resumeState) {
+        if(!chip8_load_state_file(&machine, resumeState)) {
+            exit(EXIT_FAILURE);
+        }
+        machine.draw = 1;
+    }
+    // F5/F9 save and load this one
+    char statePath[1024];
+    snprintf(statePath, sizeof(statePath), "%s.state", game);
+#ifdef CHIP8_PROFILE
+    machine.profile = chip8_profile_create();
+#endif
+
+    u64 framesPublished = 0;
+    u64 now = sched_now();
+    sched_event tick, display;
+    sched_event_init(&tick, tickRate, now);
+    sched_event_init(&display, displayRate, now);
+    // never try to make up for more than a quarter second at once
+    u32 tickCatchup = (u32)(tickRate / 4) + 1;
 
-            processorLastTime = currentTime;
-            chip8_cycle();
+    speed_stats stats;
+    speed_stats_reset(&stats, now);
 
-            if(draw) {
-                draw = 0;
-                chip8_draw(window);
-            }
+    // 4MB of deltas, at 60 ticks a second that's ten minutes for most games
+    chip8_rewind* history = chip8_rewind_create(4 << 20, 60 * 60 * 10);
 
+    while (running) {
+        now = sched_now();
+        u32 ticks = sched_event_due(&tick, now, tickCatchup);
+        i32 refresh = sched_event_due(&display, now, 1) != 0;
+        i32 turbo = uncapped || fastForward;
+        u32 speed = uncapped ? 0 : fastForwardSpeed;
+
+        if(turbo) {
+            // ticks have no wall clock meaning here, poll input along
+            // with the display so it stays responsive
+            if(refresh) update_keypad();
+        } else if(ticks) {
+            update_keypad();
+        }
+
+        if(saveStateRequested) {
+            saveStateRequested = 0;
+            if(chip8_save_state_file(&machine, statePath)) {
+                printf("saved %s\n", statePath);
+            }
+        }
+        if(traceRequested) {
+            traceRequested = 0;
+            if(chip8_trace_request(&machine, chip8TracePath)) {
+                printf("trace written to %s\n", chip8TracePath);
+            }
+        }
+        if(recordingInput && (loadStateRequested || rewinding)) {
+            // the log only makes sense as one straight run from boot
+            loadStateRequested = 0;
+            rewinding = 0;
+            printf("no loading or rewinding while recording input\n");
+        }
+        if(romStep && (!libraryDir || recordingInput)) {
+            romStep = 0;
+        }
+        if(romStep) {
+            // straight to the neighbouring rom, history belongs to the old one
+            romIndex = (romIndex + library.count + (u32)romStep) % library.count;
+            romStep = 0;
+            chip8_romlib_path(&library, romIndex, game, sizeof(game));
+            u32 ipf = boot_game(game, &library.entries[romIndex], seed, defaultInstructionsPerFrame);
+            if(ipf) {
+                instructionsPerFrame = ipf;
+                snprintf(statePath, sizeof(statePath), "%s.state", game);
+                chip8_rewind_clear(history);
+                printf("%s\n", game);
+            }
+        }
+        if(loadStateRequested) {
+            loadStateRequested = 0;
+            if(chip8_load_state_file(&machine, statePath)) {
+                machine.draw = 1;
+                chip8_rewind_clear(history);
+            }
         }
 
-        if( (currentTime - timerLastTime) > timerHZ) {
+        // a frame of history per loop that moved the machine forward
+        i32 record = !rewinding && (ticks != 0 || turbo);
+        if(rewinding) {
+            // one recorded frame back per tick, the core stands still
+            keyState = chip8_key_queue_drain(&keyQueue, keyState);
+            pendingPress = answeredPress = 0;
+            while(ticks--) {
+                if(!chip8_rewind_step(history, &machine)) break;
+            }
+            machine.draw = 1;
+        } else if(turbo && speed == 0) {
+            // flat out until the next refresh, frames in between are skipped
+            do {
+                for(u32 i = 0; i < 16; i++) {
+                    stats.instructions += run_tick(instructionsPerFrame);
+                }
+                stats.ticks += 16;
+            } while(sched_now() < display.next);
+        } else {
+            if(turbo) ticks *= speed;
+            stats.ticks += ticks;
+            while(ticks--) {
+                stats.instructions += run_tick(instructionsPerFrame);
+            }
+        }
+        if(record) {
+            chip8_rewind_record(history, &machine);
+        }
 
-            timerLastTime =  currentTime;
-            //printf("timer update!\n");
+        // at most one frame per display refresh, whatever the speed
+        if(refresh && machine.draw) {
+            machine.draw = 0;
+            chip8_frame* frame = tb_back(&frames);
+            memcpy(frame->canvas, machine.canvas, sizeof(frame->canvas));
+            frame->hires = machine.hires;
+            frame->inputTime = answeredPress;
+            answeredPress = 0;
+            frame->sequence = ++framesPublished;
+            tb_publish(&frames);
+        }
 
-            if(delayTimer > 0)
-                delayTimer -= 1;
+        if(refresh && now - stats.start >= 1000000000ull) {
+            double seconds = (double)(now - stats.start) / 1e9;
+            char title[128];
+            snprintf(title, sizeof(title), "Chip8 - %s - %.2f MIPS %.1fx%s",
+                    path_basename(game),
+                    (double)stats.instructions / seconds / 1e6,
+                    (double)stats.ticks / seconds / tickRate,
+                    turbo ? " >>" : "");
+            SDL_SetWindowTitle(window, title);
+            speed_stats_reset(&stats, now);
+        }
 
-            if(soundTimer > 0)
-                soundTimer -= 1;
+        if(!turbo && !rewinding && chip8_key_blocked(&machine) && !machine.draw) {
+            // stuck in Fx0A, nothing to tick until some input shows up.
+            // The ticks slept through never happened as far as the machine
+            // (and an input log) is concerned, the one after the wakeup is
+            // due right away so a press gets in without waiting for it
+            SDL_WaitEventTimeout(NULL, 250);
+            tick.next = sched_now();
+        } else if(!turbo || speed != 0) {
+            sched_sleep_until(tick.next < display.next ? tick.next : display.next);
         }
+    }
 
-        update_keypad();
+    __atomic_store_n(&presenting, 0, __ATOMIC_RELEASE);
+    SDL_WaitThread(renderer, NULL);
+    if(inputLatency.count) {
+        printf("press to pixel: %" PRIu64 " presses, min %.1fms avg %.1fms max %.1fms\n",
+                inputLatency.count, inputLatency.min / 1e6,
+                (double)inputLatency.total / inputLatency.count / 1e6, inputLatency.max / 1e6);
+    }
+    SDL_GL_DeleteContext(rc.context);
+    SDL_DestroyWindow(window);
+    audio_close();
+    SDL_Quit();
+    chip8_rewind_dispose(history);
+    if(libraryDir) {
+        chip8_romlib_close(&library);
     }
 
+    if(recordingInput) {
+        u64 hash = chip8_state_hash(&machine);
+        if(chip8_input_log_write(&inputLog, inputLogPath, frameCount, hash)) {
+            printf("recorded %" PRIu64 " frames to %s, final state %016" PRIx64 "\n",
+                    frameCount, inputLogPath, hash);
+        }
+        chip8_input_log_dispose(&inputLog);
+    }
 
+#ifdef CHIP8_PROFILE
+    chip8_profile_report(machine.profile, stdout);
+    chip8_profile_write_folded(machine.profile, "chip8.folded");
+#endif
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,210 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "defs.h"
+
+// Guest profiler, only built with -DCHIP8_PROFILE. Counts executions per
+// opcode class and per address, and follows 2NNN/00EE to keep a call tree
+// so every instruction is charged to the subroutine chain it ran under.
+// The tree gives inclusive/exclusive counts per subroutine and a folded
+// stack file ("main;sub_2a4;sub_31c 1234" per line) for flame graph tools.
+//
+// Included from chip8.h, which calls chip8_profile_step before every
+// instruction the interpreter runs. Code run by the recompiler isn't seen.
+
+#define PROFILE_MAX_NODES 16384
+#define PROFILE_ROOT 0
+
+typedef struct profile_node {
+    u16 entry;   // subroutine address, PC_START_LOC for the root
+    u32 parent;
+    u32 child;   // first child, 0 is none (the root is never a child)
+    u32 sibling; // next child of the same parent
+    u64 self;    // instructions run directly in this call path
+} profile_node;
+
+typedef struct chip8_profile {
+    u64          ops[CHIP8_OP_COUNT];
+    u64          addresses[CHIP8_MEMORY_SIZE];
+    u64          calls[CHIP8_MEMORY_SIZE]; // by subroutine entry
+    u64          total;
+    u32          current;   // node the machine is running in
+    u32          nodeCount;
+    u32          overflows; // calls that didn't get a node of their own
+    u32          overflowDepth; // of those, how many haven't returned yet
+    profile_node nodes[PROFILE_MAX_NODES];
+} chip8_profile;
+
+static chip8_profile*
+chip8_profile_create() {
+    chip8_profile* p = calloc(1, sizeof(chip8_profile));
+    assert(p);
+    p->nodes[PROFILE_ROOT].entry = PC_START_LOC;
+    p->nodeCount = 1;
+    return p;
+}
+
+// Out of nodes the callee is charged to the caller, and so is everything
+// it calls until it returns
+static void
+chip8_profile_enter(chip8_profile* p, u16 entry) {
+
+    p->calls[entry] += 1;
+    if(p->overflowDepth) {
+        p->overflows += 1;
+        p->overflowDepth += 1;
+        return;
+    }
+    profile_node* parent = &p->nodes[p->current];
+    u32 prev = 0;
+    for(u32 n = parent->child; n; n = p->nodes[n].sibling) {
+        if(p->nodes[n].entry == entry) {
+            p->current = n;
+            return;
+        }
+        prev = n;
+    }
+    if(p->nodeCount == PROFILE_MAX_NODES) {
+        p->overflows += 1;
+        p->overflowDepth += 1;
+        return;
+    }
+    u32 n = p->nodeCount++;
+    p->nodes[n] = (profile_node){ .entry = entry, .parent = p->current };
+    if(prev) p->nodes[prev].sibling = n;
+    else parent->child = n;
+    p->current = n;
+}
+
+static inline void
+chip8_profile_leave(chip8_profile* p) {
+    if(p->overflowDepth) {
+        p->overflowDepth -= 1;
+    } else if(p->current != PROFILE_ROOT) {
+        p->current = p->nodes[p->current].parent;
+    }
+}
+
+// stackpointer is the guest's before the instruction, calls and returns
+// that trap on it (STACK_VALIDATION) don't move
+static inline void
+chip8_profile_step(chip8_profile* p, u16 pc, const chip8_instr* in, u8 stackpointer) {
+
+    p->ops[chip8OpIndex[in->opcode]] += 1;
+    p->addresses[pc] += 1;
+    p->nodes[p->current].self += 1;
+    p->total += 1;
+
+    // the call is charged to the caller, the return to the callee
+    if((in->opcode & 0xF000) == 0x2000) {
+        if(stackpointer + 1 <= 15) chip8_profile_enter(p, in->nnn);
+    } else if(in->opcode == 0x00EE) {
+        if(stackpointer != 0) chip8_profile_leave(p);
+    }
+}
+
+static i32
+profile_sort_desc(const void* l, const void* r) {
+    u64 a = *(const u64*)l, b = *(const u64*)r;
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+// Prints opcode classes, the hottest addresses and every subroutine with
+// its call count and inclusive/exclusive instruction counts.
+static void
+chip8_profile_report(const chip8_profile* p, FILE* fp) {
+
+    static const char* names[] = {
+#define CHIP8_OP_NAME(NAME) #NAME,
+        CHIP8_OPS(CHIP8_OP_NAME)
+#undef CHIP8_OP_NAME
+    };
+    double total = p->total ? (double)p->total : 1.0;
+
+    // count in the high bits, index in the low 16 so one sort does it
+    u64* order = malloc(CHIP8_MEMORY_SIZE * sizeof(u64));
+    assert(order);
+    fprintf(fp, "# %" PRIu64 " instructions\n# opcode count percent\n", p->total);
+    for(u32 i = 0; i < CHIP8_OP_COUNT; i++) order[i] = p->ops[i] << 16 | i;
+    qsort(order, CHIP8_OP_COUNT, sizeof(u64), profile_sort_desc);
+    for(u32 i = 0; i < CHIP8_OP_COUNT && (order[i] >> 16); i++) {
+        u32 op = order[i] & 0xFFFF;
+        fprintf(fp, "%s %" PRIu64 " %.2f\n", names[op], p->ops[op], 100.0 * p->ops[op] / total);
+    }
+
+    fprintf(fp, "# address count percent\n");
+    for(u32 i = 0; i < CHIP8_MEMORY_SIZE; i++) order[i] = p->addresses[i] << 16 | i;
+    qsort(order, CHIP8_MEMORY_SIZE, sizeof(u64), profile_sort_desc);
+    for(u32 i = 0; i < 32 && (order[i] >> 16); i++) {
+        u32 addr = order[i] & 0xFFFF;
+        fprintf(fp, "%03x %" PRIu64 " %.2f\n", addr, p->addresses[addr], 100.0 * p->addresses[addr] / total);
+    }
+
+    // Subtree totals, children always come after their parent. Inclusive
+    // only counts the outermost frame of a recursive subroutine so nothing
+    // is counted twice.
+    u64* subtree = calloc(p->nodeCount, sizeof(u64));
+    u64* inclusive = calloc(CHIP8_MEMORY_SIZE, sizeof(u64));
+    u64* exclusive = calloc(CHIP8_MEMORY_SIZE, sizeof(u64));
+    assert(subtree && inclusive && exclusive);
+    for(u32 n = p->nodeCount; n-- > 0;) {
+        subtree[n] += p->nodes[n].self;
+        if(n != PROFILE_ROOT) subtree[p->nodes[n].parent] += subtree[n];
+    }
+    for(u32 n = 0; n < p->nodeCount; n++) {
+        u16 entry = p->nodes[n].entry;
+        exclusive[entry] += p->nodes[n].self;
+        i32 outermost = 1;
+        for(u32 a = n; a != PROFILE_ROOT && outermost;) {
+            a = p->nodes[a].parent;
+            if(p->nodes[a].entry == entry) outermost = 0;
+        }
+        if(outermost) inclusive[entry] += subtree[n];
+    }
+
+    fprintf(fp, "# subroutine calls inclusive exclusive\n");
+    for(u32 i = 0; i < CHIP8_MEMORY_SIZE; i++) order[i] = inclusive[i] << 16 | i;
+    qsort(order, CHIP8_MEMORY_SIZE, sizeof(u64), profile_sort_desc);
+    for(u32 i = 0; i < CHIP8_MEMORY_SIZE && (order[i] >> 16); i++) {
+        u32 addr = order[i] & 0xFFFF;
+        fprintf(fp, "%03x %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                addr, p->calls[addr], inclusive[addr], exclusive[addr]);
+    }
+    if(p->overflows) {
+        fprintf(fp, "# %u calls past the node limit were charged to their caller\n", p->overflows);
+    }
+    free(order);
+    free(subtree);
+    free(inclusive);
+    free(exclusive);
+}
+
+// One line per call path that ran anything, root first.
+static i32
+chip8_profile_write_folded(const chip8_profile* p, const char* path) {
+
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        printf("failed to open %s\n", path);
+        return 0;
+    }
+    for(u32 n = 0; n < p->nodeCount; n++) {
+        if(!p->nodes[n].self) continue;
+        u16 chain[256];
+        u32 depth = 0;
+        for(u32 a = n; a != PROFILE_ROOT && depth < SIZEOF_ARRAY(chain); a = p->nodes[a].parent) {
+            chain[depth++] = p->nodes[a].entry;
+        }
+        fprintf(fp, "main");
+        while(depth--) fprintf(fp, ";sub_%03x", chain[depth]);
+        fprintf(fp, " %" PRIu64 "\n", p->nodes[n].self);
+    }
+    fclose(fp);
+    return 1;
+}
+
+#endif /* PROFILER_H */
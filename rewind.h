@@ -0,0 +1,200 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "defs.h"
+#include "chip8.h"
+#include "savestate.h"
+
+// Rewind history. Once per frame the machine (the save state part of it,
+// see savestate.h) is XORed against the previously recorded frame and only
+// the words that changed are kept, as runs of
+//
+//   u16 unchanged words, u16 changed words, changed words XOR previous
+//
+// Most of memory and the canvas stay the same between frames, so a frame
+// is typically a few dozen bytes. Applying a delta to the newest frame
+// gives back the one before it, so stepping back just walks the ring from
+// the newest end. When the ring is full the oldest frames fall off.
+
+#define REWIND_WORDS (CHIP8_STATE_SIZE / 8)
+_Static_assert(CHIP8_STATE_SIZE % 8 == 0, "rewind works on whole words");
+
+// worst case, every other word changed
+#define REWIND_MAX_DELTA (REWIND_WORDS * 8 + (REWIND_WORDS / 2 + 1) * 4)
+
+typedef struct rewind_frame {
+    u32 offset; // into data
+    u32 size;   // bytes of delta
+    u32 lap;    // chip8_rewind.lap when it was written
+} rewind_frame;
+
+typedef struct chip8_rewind {
+    u64           latest[REWIND_WORDS]; // machine as of the newest frame
+    i32           hasLatest;
+
+    u8*           data;
+    u32           capacity;
+    u32           write;  // where the next delta goes
+    u32           lap;    // times write went back to 0
+
+    rewind_frame* frames;
+    u32           maxFrames;
+    u32           first;  // oldest frame
+    u32           count;
+} chip8_rewind;
+
+static chip8_rewind*
+chip8_rewind_create(u32 capacity, u32 maxFrames) {
+    assert(capacity >= REWIND_MAX_DELTA && maxFrames > 0);
+    chip8_rewind* rw = calloc(1, sizeof(chip8_rewind));
+    assert(rw);
+    rw->data = malloc(capacity);
+    rw->frames = malloc(maxFrames * sizeof(rewind_frame));
+    assert(rw->data && rw->frames);
+    rw->capacity = capacity;
+    rw->maxFrames = maxFrames;
+    return rw;
+}
+
+static void
+chip8_rewind_dispose(chip8_rewind* rw) {
+    free(rw->data);
+    free(rw->frames);
+    free(rw);
+}
+
+// forget all history, e.g. after loading a state
+static void
+chip8_rewind_clear(chip8_rewind* rw) {
+    rw->hasLatest = 0;
+    rw->write = 0;
+    rw->lap = 0;
+    rw->first = 0;
+    rw->count = 0;
+}
+
+static void
+rewind_drop_oldest(chip8_rewind* rw) {
+    rw->first = (rw->first + 1) % rw->maxFrames;
+    rw->count -= 1;
+}
+
+// XOR delta of cur against prev, returns its size. prev is brought up to
+// date on the way, only the words that changed are touched.
+static u32
+rewind_encode(u64* prev, const u64* cur, u8* out) {
+    u32 size = 0;
+    u32 i = 0;
+    while(i < REWIND_WORDS) {
+        u32 skip = i;
+        // long unchanged stretches are the common case, skip them 4 at a time
+        while(i + 4 <= REWIND_WORDS &&
+                ((prev[i] ^ cur[i]) | (prev[i + 1] ^ cur[i + 1]) |
+                 (prev[i + 2] ^ cur[i + 2]) | (prev[i + 3] ^ cur[i + 3])) == 0) i += 4;
+        while(i < REWIND_WORDS && prev[i] == cur[i]) i++;
+        if(i == REWIND_WORDS) break;
+        u32 start = i;
+        while(i < REWIND_WORDS && prev[i] != cur[i]) i++;
+
+        u16 header[2] = { (u16)(start - skip), (u16)(i - start) };
+        memcpy(out + size, header, sizeof(header));
+        size += sizeof(header);
+        for(u32 w = start; w < i; w++) {
+            u64 x = prev[w] ^ cur[w];
+            memcpy(out + size, &x, sizeof(x));
+            size += sizeof(x);
+            prev[w] = cur[w];
+        }
+    }
+    return size;
+}
+
+static void
+rewind_apply(u64* words, const u8* delta, u32 size) {
+    u32 at = 0;
+    u32 i = 0;
+    while(at < size) {
+        u16 header[2];
+        memcpy(header, delta + at, sizeof(header));
+        at += sizeof(header);
+        i += header[0];
+        for(u32 n = 0; n < header[1]; n++, i++) {
+            u64 x;
+            memcpy(&x, delta + at, sizeof(x));
+            at += sizeof(x);
+            words[i] ^= x;
+        }
+    }
+}
+
+// Call once per frame.
+static void
+chip8_rewind_record(chip8_rewind* rw, const chip8* c) {
+
+    const u64* cur = (const u64*)c;
+    if(!rw->hasLatest) {
+        memcpy(rw->latest, cur, CHIP8_STATE_SIZE);
+        rw->hasLatest = 1;
+        return;
+    }
+
+    u8 delta[REWIND_MAX_DELTA];
+    u32 size = rewind_encode(rw->latest, cur, delta);
+
+    // Deltas never wrap, if it doesn't fit at the end start over at 0.
+    // Live frames are the rest of the previous lap from the oldest on,
+    // then this lap up to write, so the ones in the way are at the front:
+    // anything from before the previous lap and the previous lap's up to
+    // the end of the new one. Offsets alone can't tell the laps apart,
+    // empty deltas sit at the same offset as whatever follows them.
+    u32 offset = rw->write;
+    if(offset + size > rw->capacity) {
+        offset = 0;
+        rw->lap += 1;
+    }
+    while(rw->count) {
+        const rewind_frame* oldest = &rw->frames[rw->first];
+        u32 age = rw->lap - oldest->lap;
+        i32 inTheWay = age > 1 || (age == 1 && oldest->offset < offset + size);
+        if(!inTheWay && rw->count < rw->maxFrames) break;
+        rewind_drop_oldest(rw);
+    }
+    memcpy(rw->data + offset, delta, size);
+    rw->frames[(rw->first + rw->count) % rw->maxFrames] = (rewind_frame){ offset, size, rw->lap };
+    rw->count += 1;
+    rw->write = offset + size;
+}
+
+// Puts the machine back one recorded frame, returns 0 when history ran out.
+static i32
+chip8_rewind_step(chip8_rewind* rw, chip8* c) {
+
+    if(!rw->hasLatest) return 0;
+    if(rw->count) {
+        u32 newest = (rw->first + rw->count - 1) % rw->maxFrames;
+        const rewind_frame* f = &rw->frames[newest];
+        rewind_apply(rw->latest, rw->data + f->offset, f->size);
+        rw->write = f->offset;
+        rw->lap = f->lap;
+        rw->count -= 1;
+    }
+    memcpy(c, rw->latest, CHIP8_STATE_SIZE);
+    chip8_invalidate(c, 0, CHIP8_MEMORY_SIZE);
+    return rw->count != 0;
+}
+
+// bytes of delta currently held
+static u64
+chip8_rewind_bytes(const chip8_rewind* rw) {
+    u64 total = 0;
+    for(u32 i = 0; i < rw->count; i++) {
+        total += rw->frames[(rw->first + i) % rw->maxFrames].size;
+    }
+    return total;
+}
+
+#endif /* REWIND_H */
@@ -0,0 +1,318 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef ROMLIB_H
+#define ROMLIB_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defs.h"
+#include "chip8.h"
+
+// ROM library. A directory of ROMs is scanned once into an index file
+// (.chip8index inside it) holding, per ROM, its content hash, size and
+// settings: instructions per frame, quirks and keymap. The index is a
+// header and fixed size entries sorted by name, and is mmap'ed as is, so
+// opening a library of thousands of ROMs and finding one costs a binary
+// search. It is rebuilt when the directory changed since it was written,
+// settings carry over to ROMs with the same hash (renamed or moved ones).
+
+#define CHIP8_ROMLIB_MAGIC   0x424C3843u // "C8LB"
+#define CHIP8_ROMLIB_VERSION 1
+#define CHIP8_ROMLIB_INDEX   ".chip8index"
+#define CHIP8_ROM_MAX_SIZE   (CHIP8_MEMORY_SIZE - PC_START_LOC)
+
+// which settings chip8_romlib_update replaces
+#define CHIP8_ROM_SET_INSTRUCTIONS 0x1
+#define CHIP8_ROM_SET_QUIRKS       0x2
+#define CHIP8_ROM_SET_KEYMAP       0x4
+
+typedef struct chip8_rom_entry {
+    u64  hash;                 // chip8_rom_hash of the contents
+    u32  size;
+    u32  instructionsPerFrame; // 0 is the frontend default
+    u8   quirks;               // CHIP8_QUIRK_*
+    u8   hasKeymap;
+    u8   keymap[16];           // host key (ASCII) for every chip8 key
+    char name[94];             // file name inside the library
+} chip8_rom_entry;
+
+_Static_assert(sizeof(chip8_rom_entry) == 128, "index entries are fixed size");
+
+typedef struct chip8_romlib_header {
+    u32 magic;
+    u32 version;
+    u32 count;
+    u32 reserved;
+} chip8_romlib_header;
+
+typedef struct chip8_romlib {
+    char                   dir[512];
+    void*                  map;
+    size_t                 mapSize;
+    const chip8_rom_entry* entries;
+    u32                    count;
+} chip8_romlib;
+
+static u64
+chip8_rom_hash(const u8* data, size_t size) {
+    u64 hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Maps the file and copies it straight into machine memory, no buffer in
+// between. Returns 0 with a message when it's missing or doesn't fit.
+static i32
+chip8_load_rom_file(chip8* c, const char* path, u64* hash) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("%s not found\n", path);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        printf("%s is not a file\n", path);
+        close(fd);
+        return 0;
+    }
+    if(st.st_size == 0 || st.st_size >= CHIP8_ROM_MAX_SIZE) {
+        printf("%s: %s\n", path, st.st_size ? "Too large file!" : "empty file");
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    const u8* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        printf("failed to map %s\n", path);
+        return 0;
+    }
+    chip8_load_rom(c, data, size);
+    if(hash) *hash = chip8_rom_hash(data, size);
+    munmap((void*)data, size);
+    return 1;
+}
+
+static i32
+romlib_compare_name(const void* l, const void* r) {
+    return strcmp(((const chip8_rom_entry*)l)->name, ((const chip8_rom_entry*)r)->name);
+}
+
+static i32
+romlib_compare_hash(const void* l, const void* r) {
+    u64 a = ((const chip8_rom_entry*)l)->hash, b = ((const chip8_rom_entry*)r)->hash;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void
+romlib_index_path(const chip8_romlib* lib, char* path, size_t size) {
+    snprintf(path, size, "%s/%s", lib->dir, CHIP8_ROMLIB_INDEX);
+}
+
+static void
+romlib_unmap(chip8_romlib* lib) {
+    if(lib->map) munmap(lib->map, lib->mapSize);
+    lib->map = NULL;
+    lib->entries = NULL;
+    lib->count = 0;
+}
+
+static i32
+romlib_map(chip8_romlib* lib) {
+
+    char path[1024];
+    romlib_index_path(lib, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(chip8_romlib_header)) {
+        close(fd);
+        return 0;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return 0;
+
+    const chip8_romlib_header* header = map;
+    if(header->magic != CHIP8_ROMLIB_MAGIC || header->version != CHIP8_ROMLIB_VERSION ||
+            sizeof(chip8_romlib_header) + (size_t)header->count * sizeof(chip8_rom_entry) != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+    lib->map = map;
+    lib->mapSize = (size_t)st.st_size;
+    lib->entries = (const chip8_rom_entry*)(header + 1);
+    lib->count = header->count;
+    return 1;
+}
+
+static i32
+romlib_write(chip8_romlib* lib, const chip8_rom_entry* entries, u32 count) {
+
+    char path[1024], tmp[1040];
+    romlib_index_path(lib, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* fp = fopen(tmp, "wb");
+    if(!fp) {
+        printf("failed to open %s\n", tmp);
+        return 0;
+    }
+    chip8_romlib_header header = { CHIP8_ROMLIB_MAGIC, CHIP8_ROMLIB_VERSION, count, 0 };
+    i32 ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if(count) ok = ok && fwrite(entries, sizeof(chip8_rom_entry), count, fp) == count;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        printf("failed to write %s\n", path);
+        remove(tmp);
+        return 0;
+    }
+    // the rename bumped the directory, the index has to stay the newer one
+    utimensat(AT_FDCWD, path, NULL, 0);
+    romlib_unmap(lib);
+    return romlib_map(lib);
+}
+
+// Hashes every ROM sized regular file in the directory and writes a new
+// index, keeping the settings of ROMs that were already known.
+static i32
+romlib_scan(chip8_romlib* lib) {
+
+    DIR* dir = opendir(lib->dir);
+    if(!dir) {
+        printf("failed to open %s\n", lib->dir);
+        return 0;
+    }
+
+    // old entries by hash, to carry settings over
+    chip8_rom_entry* old = NULL;
+    u32 oldCount = lib->count;
+    if(oldCount) {
+        old = malloc(oldCount * sizeof(chip8_rom_entry));
+        assert(old);
+        memcpy(old, lib->entries, oldCount * sizeof(chip8_rom_entry));
+        qsort(old, oldCount, sizeof(chip8_rom_entry), romlib_compare_hash);
+    }
+
+    u32 count = 0, capacity = 256;
+    chip8_rom_entry* entries = malloc(capacity * sizeof(chip8_rom_entry));
+    assert(entries);
+    struct dirent* de;
+    while((de = readdir(dir)) != NULL) {
+        if(de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(entries->name)) continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", lib->dir, de->d_name);
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) continue;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size >= CHIP8_ROM_MAX_SIZE) {
+            close(fd);
+            continue;
+        }
+        const u8* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED) continue;
+
+        if(count == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(chip8_rom_entry));
+            assert(entries);
+        }
+        chip8_rom_entry* e = &entries[count++];
+        memset(e, 0, sizeof(*e));
+        e->hash = chip8_rom_hash(data, (size_t)st.st_size);
+        e->size = (u32)st.st_size;
+        munmap((void*)data, (size_t)st.st_size);
+
+        const chip8_rom_entry* known = old ?
+            bsearch(e, old, oldCount, sizeof(chip8_rom_entry), romlib_compare_hash) : NULL;
+        if(known) *e = *known;
+        memset(e->name, 0, sizeof(e->name));
+        strcpy(e->name, de->d_name);
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(chip8_rom_entry), romlib_compare_name);
+    i32 ok = romlib_write(lib, entries, count);
+    free(entries);
+    if(old) free(old);
+    return ok;
+}
+
+// Opens the library in dir, rescanning it only if files were added,
+// removed or renamed since the index was written.
+static i32
+chip8_romlib_open(chip8_romlib* lib, const char* dir) {
+
+    memset(lib, 0, sizeof(*lib));
+    snprintf(lib->dir, sizeof(lib->dir), "%s", dir);
+
+    char path[1024];
+    romlib_index_path(lib, path, sizeof(path));
+    struct stat dirStat, indexStat;
+    if(stat(dir, &dirStat) != 0 || !S_ISDIR(dirStat.st_mode)) {
+        printf("%s is not a directory\n", dir);
+        return 0;
+    }
+    i32 mapped = romlib_map(lib);
+    i32 fresh = mapped && stat(path, &indexStat) == 0 &&
+        (indexStat.st_mtim.tv_sec > dirStat.st_mtim.tv_sec ||
+         (indexStat.st_mtim.tv_sec == dirStat.st_mtim.tv_sec &&
+          indexStat.st_mtim.tv_nsec >= dirStat.st_mtim.tv_nsec));
+    return fresh || romlib_scan(lib);
+}
+
+static void
+chip8_romlib_close(chip8_romlib* lib) {
+    romlib_unmap(lib);
+}
+
+// index of the ROM called name, -1 if there is none
+static i32
+chip8_romlib_find(const chip8_romlib* lib, const char* name) {
+    chip8_rom_entry key;
+    memset(&key, 0, sizeof(key));
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    const chip8_rom_entry* e = bsearch(&key, lib->entries, lib->count, sizeof(chip8_rom_entry), romlib_compare_name);
+    return e ? (i32)(e - lib->entries) : -1;
+}
+
+static void
+chip8_romlib_path(const chip8_romlib* lib, u32 index, char* path, size_t size) {
+    snprintf(path, size, "%s/%s", lib->dir, lib->entries[index].name);
+}
+
+// Replaces the settings in fields (CHIP8_ROM_SET_*) of one ROM, keeps the
+// others and writes the index back.
+static i32
+chip8_romlib_update(chip8_romlib* lib, u32 index, const chip8_rom_entry* settings, u32 fields) {
+    chip8_rom_entry* entries = malloc((lib->count ? lib->count : 1) * sizeof(chip8_rom_entry));
+    assert(entries);
+    memcpy(entries, lib->entries, lib->count * sizeof(chip8_rom_entry));
+    chip8_rom_entry* e = &entries[index];
+    if(fields & CHIP8_ROM_SET_INSTRUCTIONS) {
+        e->instructionsPerFrame = settings->instructionsPerFrame;
+    }
+    if(fields & CHIP8_ROM_SET_QUIRKS) {
+        e->quirks = settings->quirks;
+    }
+    if(fields & CHIP8_ROM_SET_KEYMAP) {
+        e->hasKeymap = settings->hasKeymap;
+        memcpy(e->keymap, settings->keymap, sizeof(e->keymap));
+    }
+    i32 ok = romlib_write(lib, entries, lib->count);
+    free(entries);
+    return ok;
+}
+
+#endif /* ROMLIB_H */
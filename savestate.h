@@ -0,0 +1,137 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defs.h"
+#include "chip8.h"
+
+// Save states. A state is a small header followed by the leading part of
+// struct chip8 (everything up to the decode cache) copied as is, so taking
+// and restoring one is a single memcpy. State files have exactly the same
+// bytes and are mmap'ed on load, nothing is parsed. The layout is the host
+// one (little endian everywhere we run), the version guards against the
+// struct changing under old files.
+
+#define CHIP8_STATE_MAGIC   0x54533843u // "C8ST"
+#define CHIP8_STATE_VERSION 4
+#define CHIP8_STATE_SIZE    offsetof(chip8, decoded)
+
+// the file layout is the struct layout, make sure it is the one we expect
+_Static_assert(offsetof(chip8, canvas) == 0, "state layout changed");
+_Static_assert(offsetof(chip8, memory) == 2048, "state layout changed");
+_Static_assert(offsetof(chip8, rngState) == 67584, "state layout changed");
+_Static_assert(offsetof(chip8, quirks) == 67692, "state layout changed");
+_Static_assert(offsetof(chip8, decoded) == 67704, "state layout changed");
+
+typedef struct chip8_state_header {
+    u32 magic;
+    u32 version;
+    u32 size;     // CHIP8_STATE_SIZE
+    u32 reserved;
+} chip8_state_header;
+
+typedef struct chip8_state {
+    chip8_state_header header;
+    u8                 machine[CHIP8_STATE_SIZE];
+} chip8_state;
+
+static void
+chip8_save_state(const chip8* c, chip8_state* state) {
+    state->header = (chip8_state_header){ CHIP8_STATE_MAGIC, CHIP8_STATE_VERSION, CHIP8_STATE_SIZE, 0 };
+    memcpy(state->machine, c, CHIP8_STATE_SIZE);
+}
+
+static i32
+chip8_state_valid(const chip8_state* state) {
+    return state->header.magic == CHIP8_STATE_MAGIC &&
+        state->header.version == CHIP8_STATE_VERSION &&
+        state->header.size == CHIP8_STATE_SIZE;
+}
+
+// Returns 0 and leaves the machine alone if the state doesn't match this
+// build. Decoded instructions can't be trusted after memory was replaced,
+// so the whole cache is dropped (and marked dirty for translators).
+static i32
+chip8_load_state(chip8* c, const chip8_state* state) {
+    if(!chip8_state_valid(state)) return 0;
+    memcpy(c, state->machine, CHIP8_STATE_SIZE);
+    chip8_invalidate(c, 0, CHIP8_MEMORY_SIZE);
+    c->trap = chip8_trap_none;
+    return 1;
+}
+
+// FNV-1a over the machine, equal hashes mean equal machines (canvas,
+// memory, registers, timers, keypad and generator)
+static u64
+chip8_state_hash(const chip8* c) {
+    const u8* data = (const u8*)c;
+    u64 hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < CHIP8_STATE_SIZE; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static i32
+chip8_save_state_file(const chip8* c, const char* path) {
+
+    chip8_state state;
+    chip8_save_state(c, &state);
+
+    // write next to it and rename, a crash never leaves half a state behind
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* fp = fopen(tmp, "wb");
+    if(!fp) {
+        printf("failed to open %s\n", tmp);
+        return 0;
+    }
+    i32 ok = fwrite(&state, sizeof(state), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        printf("failed to write %s\n", path);
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+static i32
+chip8_load_state_file(chip8* c, const char* path) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        printf("%s not found\n", path);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(chip8_state)) {
+        printf("%s is not a save state\n", path);
+        close(fd);
+        return 0;
+    }
+    const chip8_state* state = mmap(NULL, sizeof(chip8_state), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(state == MAP_FAILED) {
+        printf("failed to map %s\n", path);
+        return 0;
+    }
+    i32 ok = chip8_load_state(c, state);
+    if(!ok) {
+        printf("%s was saved by an incompatible version\n", path);
+    }
+    munmap((void*)state, sizeof(chip8_state));
+    return ok;
+}
+
+#endif /* SAVESTATE_H */
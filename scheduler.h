@@ -0,0 +1,62 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <time.h>
+#include <errno.h>
+#include "defs.h"
+
+// Wall clock pacing for the interactive frontend. Every periodic thing
+// (instructions, timers, display) is a sched_event with its own period
+// on CLOCK_MONOTONIC. The loop sleeps until the earliest deadline with
+// an absolute clock_nanosleep and only spins for the last stretch, where
+// the kernel wakeup jitter would otherwise make us late.
+
+#define SCHED_SPIN_NS 200000ull // busy wait at most this long before a deadline
+
+typedef struct sched_event {
+    u64 period; // ns
+    u64 next;   // absolute deadline, ns
+} sched_event;
+
+static u64
+sched_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static void
+sched_event_init(sched_event* e, double hz, u64 now) {
+    assert(hz > 0);
+    e->period = (u64)(1e9 / hz);
+    if(e->period == 0) e->period = 1;
+    e->next = now + e->period;
+}
+
+// Number of periods that elapsed since the last call, at most maxCatchup.
+// When we fell further behind than that (stopped in a debugger, machine
+// suspended) the rest is dropped instead of running it all at once.
+static u32
+sched_event_due(sched_event* e, u64 now, u32 maxCatchup) {
+    if(now < e->next) return 0;
+    u64 count = (now - e->next) / e->period + 1;
+    e->next += count * e->period;
+    return count > maxCatchup ? maxCatchup : (u32)count;
+}
+
+static void
+sched_sleep_until(u64 deadline) {
+    u64 now = sched_now();
+    if(deadline > now + SCHED_SPIN_NS) {
+        u64 wake = deadline - SCHED_SPIN_NS;
+        struct timespec ts = { (time_t)(wake / 1000000000ull), (long)(wake % 1000000000ull) };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+    while(sched_now() < deadline);
+}
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,363 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Regression checks for the headless core, one function per bug that got
+// through once. Prints a line per check and exits non zero if any failed.
+//
+//  chip8-test
+//
+// Linked against libchip8.so, its checks go through the public interface.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "chip8.h"
+#include "savestate.h"
+#include "inputlog.h"
+#include "rewind.h"
+#include "lockstep.h"
+#include "romlib.h"
+#include "libchip8.h"
+
+#define TEST_EXPECT(COND) \
+    do{ if(!(COND)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #COND); return 0; } }while(0)
+
+static u32 testRng = 1;
+
+static u32
+test_random() {
+    testRng ^= testRng << 13;
+    testRng ^= testRng >> 17;
+    testRng ^= testRng << 5;
+    return testRng;
+}
+
+// Moves a sprite right every frame unless key 0 is down
+static const u8 testDrawRom[] = {
+    0x00, 0xE0, // 200 cls
+    0xA2, 0x10, // 202 I = sprite
+    0xE1, 0x9E, // 204 skip if key V1 (0) is down
+    0x70, 0x01, // 206 V0 += 1
+    0xD0, 0x15, // 208 draw at V0, V1
+    0x12, 0x00, // 20A loop
+    0x00, 0x00, 0x00, 0x00,
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 210 sprite
+};
+
+// A log recorded the way chip8 -R does (the frontend clearing draw as it
+// presents) replays to the same hash headless
+static i32
+test_replay_hash() {
+
+    static chip8 recorder, player;
+    chip8_init(&recorder);
+    TEST_EXPECT(chip8_load_rom(&recorder, testDrawRom, sizeof(testDrawRom)));
+    chip8_seed(&recorder, 1234);
+    recorder.draw = 1;
+
+    chip8_input_log log;
+    chip8_input_log_init(&log, 1234, 10, 0);
+    chip8_input_log_setup(&log, &recorder);
+    u32 frames = 300;
+    u16 keys = 0;
+    for(u32 frame = 0; frame < frames; frame++) {
+        if(test_random() % 8 == 0) keys = (u16)(test_random() & 1);
+        chip8_input_log_record(&log, frame, keys);
+        chip8_run_frame(&recorder, keys, 10);
+        if(frame % 3 == 0) recorder.draw = 0; // presented
+    }
+    recorder.draw = 0;
+
+    char path[] = "/tmp/chip8-test-XXXXXX";
+    i32 fd = mkstemp(path);
+    TEST_EXPECT(fd >= 0);
+    close(fd);
+    TEST_EXPECT(chip8_input_log_write(&log, path, frames, chip8_state_hash(&recorder)));
+    chip8_input_log_dispose(&log);
+
+    chip8_input_log replay;
+    i32 read = chip8_input_log_read(&replay, path);
+    unlink(path);
+    TEST_EXPECT(read);
+    chip8_init(&player);
+    TEST_EXPECT(chip8_load_rom(&player, testDrawRom, sizeof(testDrawRom)));
+    chip8_input_log_replay(&replay, &player);
+    chip8_input_log_dispose(&replay);
+    // never presented, the flag differs but the machines don't
+    TEST_EXPECT(player.draw == 1);
+    TEST_EXPECT(chip8_state_hash(&player) == replay.header.finalHash);
+    return 1;
+}
+
+// Random changes of random size, some frames unchanged, in a ring small
+// enough to go round every few dozen frames, rewinding now and then. Every
+// step back has to give the frame recorded before.
+static i32
+test_rewind_laps() {
+
+    static chip8 c;
+    static u64 hashes[4096];
+    chip8_init(&c);
+    chip8_rewind* rw = chip8_rewind_create(REWIND_MAX_DELTA + 64 * 1024, 200);
+    u32 top = 0;
+    u32 laps = 0;
+
+    for(u32 frame = 0; frame < 3000; frame++) {
+        u32 r = test_random();
+        if(r % 3) {
+            u32 size = 8 + test_random() % 6000;
+            u32 at = test_random() % (CHIP8_MEMORY_SIZE - size);
+            memset(c.memory + at, (u8)test_random(), size);
+        }
+        u32 write = rw->write;
+        chip8_rewind_record(rw, &c);
+        laps += rw->write < write;
+        hashes[top++] = chip8_state_hash(&c);
+        TEST_EXPECT(rw->count < top);
+
+        if(r % 97 == 0 || top == SIZEOF_ARRAY(hashes)) {
+            u32 steps = test_random() % 50;
+            for(u32 i = 0; i < steps && rw->count; i++) {
+                chip8_rewind_step(rw, &c);
+                top -= 1;
+                TEST_EXPECT(chip8_state_hash(&c) == hashes[top - 1]);
+            }
+        }
+    }
+    TEST_EXPECT(laps > 10);
+    while(rw->count) {
+        chip8_rewind_step(rw, &c);
+        top -= 1;
+        TEST_EXPECT(chip8_state_hash(&c) == hashes[top - 1]);
+    }
+    chip8_rewind_dispose(rw);
+    return 1;
+}
+
+// Without key 0 down it writes a jump to itself over 20E before going
+// there, with key 0 down 20E stays V4 = 4 and it ends at 210
+static const u8 testPatchRom[] = {
+    0x60, 0x12, // 200 V0 = 12
+    0x61, 0x0E, // 202 V1 = 0E
+    0xA2, 0x0E, // 204 I = 20E
+    0xE2, 0x9E, // 206 skip if key V2 (0) is down
+    0xF1, 0x55, // 208 20E = 120E
+    0x12, 0x0E, // 20A jump 20E
+    0x00, 0x00,
+    0x64, 0x04, // 20E V4 = 4
+    0x12, 0x10, // 210 halt
+};
+
+// A clone of a machine that already patched its code decodes the patched
+// code, after a reset it must see the rom again like the original does
+static i32
+test_clone_reset() {
+
+    chip8_env* env = chip8_env_create(10, 0);
+    TEST_EXPECT(env);
+    TEST_EXPECT(chip8_env_load_rom(env, testPatchRom, sizeof(testPatchRom)));
+    chip8_env_step(env, 0, 1);
+    chip8_env* clone = chip8_env_clone(env);
+    TEST_EXPECT(clone);
+    chip8_env_step(clone, 0, 1);
+
+    chip8_env* envs[2] = { env, clone };
+    chip8_observation obs[2];
+    for(u32 i = 0; i < 2; i++) {
+        chip8_env_reset(envs[i], 1);
+        chip8_env_step(envs[i], 1, 2);
+        chip8_env_observe(envs[i], &obs[i]);
+    }
+    for(u32 i = 0; i < 2; i++) {
+        TEST_EXPECT(obs[i].pc == 0x210);
+        TEST_EXPECT(obs[i].registers[4] == 4);
+        TEST_EXPECT(obs[i].halted);
+    }
+    chip8_env_destroy(clone);
+    chip8_env_destroy(env);
+    return 1;
+}
+
+// Fx29 and Fx30 have a glyph for every digit up to F, on the interpreter
+// and on the lanes (which leave them to the same handlers)
+static i32
+test_font_digit_f() {
+
+    static chip8 c;
+    static const u16 ops[] = { 0xF029, 0xF030 };
+    static const u16 expected[] = { 0xF * 5, CHIP8_BIG_FONT + 0xF * 10 };
+    for(u32 i = 0; i < SIZEOF_ARRAY(ops); i++) {
+        u8 rom[] = { 0x60, 0x0F, (u8)(ops[i] >> 8), (u8)ops[i], 0x12, 0x04 };
+        chip8_init(&c);
+        TEST_EXPECT(chip8_load_rom(&c, rom, sizeof(rom)));
+
+        chip8_lanes lanes;
+        TEST_EXPECT(chip8_lanes_create(&lanes, &c, 2));
+        chip8_lanes_frame(&lanes, NULL, 10);
+        chip8_run_frame(&c, 0, 10);
+        TEST_EXPECT(c.trap == chip8_trap_none);
+        TEST_EXPECT(c.IReqister == expected[i]);
+        for(u32 lane = 0; lane < 2; lane++) {
+            chip8* m = &lanes.machines[lane];
+            lanes_spill(&lanes.blocks[0], lane, m);
+            TEST_EXPECT(m->trap == chip8_trap_none);
+            TEST_EXPECT(m->IReqister == expected[i]);
+        }
+        chip8_lanes_dispose(&lanes);
+    }
+    return 1;
+}
+
+// A trapped lane runs nothing, frames count the same as chip8_run whether
+// the block is on the vector ops or on the handlers
+static i32
+test_lanes_trapped() {
+
+    static chip8 c;
+    static const u8 rom[] = {
+        0x60, 0x01, // 200 V0 = 1
+        0x70, 0x01, // 202 V0 += 1
+        0x00, 0xEE, // 204 return with nothing on the stack
+    };
+    chip8_init(&c);
+    TEST_EXPECT(chip8_load_rom(&c, rom, sizeof(rom)));
+    chip8_lanes lanes;
+    TEST_EXPECT(chip8_lanes_create(&lanes, &c, 4));
+    for(u32 frame = 0; frame < 4; frame++) {
+        u32 ran = chip8_run(&c, 10);
+        chip8_tick_timers(&c);
+        lanes.blocks[0].scalarFrames = frame & 1; // handlers every other frame
+        TEST_EXPECT(chip8_lanes_frame(&lanes, NULL, 10) == 4 * (u64)ran);
+    }
+    TEST_EXPECT(c.trap == chip8_trap_stack);
+    chip8_lanes_dispose(&lanes);
+    return 1;
+}
+
+// chip8 -L with only some of -f, -q and -k keeps the stored others
+static i32
+test_romlib_fields() {
+
+    char dir[] = "/tmp/chip8-test-XXXXXX";
+    TEST_EXPECT(mkdtemp(dir));
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/DRAW", dir);
+    FILE* fp = fopen(path, "wb");
+    TEST_EXPECT(fp);
+    fwrite(testDrawRom, sizeof(testDrawRom), 1, fp);
+    fclose(fp);
+
+    chip8_romlib lib;
+    TEST_EXPECT(chip8_romlib_open(&lib, dir));
+    TEST_EXPECT(lib.count == 1);
+    chip8_rom_entry settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.instructionsPerFrame = 15;
+    settings.hasKeymap = 1;
+    memcpy(settings.keymap, "x123qweasdzc4rfv", 16);
+    TEST_EXPECT(chip8_romlib_update(&lib, 0, &settings, CHIP8_ROM_SET_INSTRUCTIONS | CHIP8_ROM_SET_KEYMAP));
+    memset(&settings, 0, sizeof(settings));
+    settings.quirks = CHIP8_QUIRK_WRAP;
+    TEST_EXPECT(chip8_romlib_update(&lib, 0, &settings, CHIP8_ROM_SET_QUIRKS));
+    chip8_romlib_close(&lib);
+
+    TEST_EXPECT(chip8_romlib_open(&lib, dir));
+    const chip8_rom_entry e = lib.entries[0];
+    chip8_romlib_close(&lib);
+    snprintf(path, sizeof(path), "%s/%s", dir, CHIP8_ROMLIB_INDEX);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/DRAW", dir);
+    unlink(path);
+    rmdir(dir);
+    TEST_EXPECT(e.instructionsPerFrame == 15);
+    TEST_EXPECT(e.quirks == CHIP8_QUIRK_WRAP);
+    TEST_EXPECT(e.hasKeymap && memcmp(e.keymap, "x123qweasdzc4rfv", 16) == 0);
+    return 1;
+}
+
+#ifdef CHIP8_PROFILE
+static const u8 testCallRom[] = {
+    0x23, 0x00, // 200 call 300
+    0x12, 0x02, // 202 halt
+};
+
+// A call past the node limit or one that traps on the guest stack doesn't
+// get a frame, its return mustn't take the caller's
+static i32
+test_profile_frames() {
+
+    static chip8 c;
+    u8 sub[] = {
+        0x24, 0x00, // 300 call 400
+        0x00, 0xEE, // 302 return
+        0x60, 0x01, // 304
+        0x00, 0xEE, // 306
+    };
+    chip8_init(&c);
+    TEST_EXPECT(chip8_load_rom(&c, testCallRom, sizeof(testCallRom)));
+    memcpy(c.memory + 0x300, sub, 4);
+    memcpy(c.memory + 0x400, sub + 4, 4);
+    chip8_profile* p = chip8_profile_create();
+    c.profile = p;
+    chip8_run(&c, 1);
+    u32 a = p->current;
+    TEST_EXPECT(a != PROFILE_ROOT && p->nodes[a].entry == 0x300);
+    p->nodeCount = PROFILE_MAX_NODES;
+    chip8_run(&c, 4); // 300 400 402 302
+    TEST_EXPECT(p->overflows == 1);
+    TEST_EXPECT(p->nodes[a].self == 4);
+    TEST_EXPECT(p->current == PROFILE_ROOT);
+    free(p);
+
+    // two subroutines calling each other until the guest stack is full
+    static const u8 recurse[] = { 0x22, 0x02, 0x22, 0x00 };
+    chip8_init(&c);
+    TEST_EXPECT(chip8_load_rom(&c, recurse, sizeof(recurse)));
+    p = chip8_profile_create();
+    c.profile = p;
+    chip8_run(&c, 100);
+    TEST_EXPECT(c.trap == chip8_trap_stack);
+    u32 depth = 0;
+    for(u32 n = p->current; n != PROFILE_ROOT; n = p->nodes[n].parent) depth++;
+    TEST_EXPECT(depth == c.stackpointer);
+    TEST_EXPECT(p->calls[0x200] + p->calls[0x202] == c.stackpointer);
+    free(p);
+    return 1;
+}
+#endif
+
+typedef struct test_case {
+    const char* name;
+    i32 (*run)();
+} test_case;
+
+static const test_case testCases[] = {
+    { "replay_hash", test_replay_hash },
+    { "rewind_laps", test_rewind_laps },
+    { "clone_reset", test_clone_reset },
+    { "font_digit_f", test_font_digit_f },
+    { "lanes_trapped", test_lanes_trapped },
+    { "romlib_fields", test_romlib_fields },
+#ifdef CHIP8_PROFILE
+    { "profile_frames", test_profile_frames },
+#endif
+};
+
+int
+main() {
+    // traps in the checks are expected, don't leave dumps around
+    chip8TracePath = "/dev/null";
+    u32 failed = 0;
+    for(u32 i = 0; i < SIZEOF_ARRAY(testCases); i++) {
+        i32 ok = testCases[i].run();
+        printf("%s %s\n", ok ? "ok  " : "FAIL", testCases[i].name);
+        failed += !ok;
+    }
+    printf("# %u of %u failed\n", failed, (u32)SIZEOF_ARRAY(testCases));
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include "defs.h"
+
+// Work stealing thread pool. Every worker owns a deque, pushes and pops
+// its own work from the back and, when empty, steals from the front of
+// the other workers deques. Tasks are expected to be coarse (a whole
+// emulator session) so a small lock per deque is plenty.
+
+typedef void (*threadpool_fn)(void* arg);
+
+typedef struct tp_task {
+    threadpool_fn fn;
+    void*         arg;
+} tp_task;
+
+typedef struct tp_deque {
+    pthread_mutex_t lock;
+    tp_task*        tasks;
+    u32             head; // steal end
+    u32             tail; // owner end
+    u32             cap;
+} tp_deque;
+
+typedef struct threadpool threadpool;
+
+typedef struct tp_worker {
+    threadpool* pool;
+    u32         index;
+    pthread_t   thread;
+} tp_worker;
+
+struct threadpool {
+    tp_deque*       deques;
+    tp_worker*      workers;
+    u32             count;
+    u32             nextQueue;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  workAvailable;
+    pthread_cond_t  allDone;
+    u32             queued;  // submitted but not yet picked up
+    u32             pending; // submitted but not yet finished
+    i32             stop;
+};
+
+static void
+tp_deque_push(tp_deque* d, tp_task task) {
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail - d->head == d->cap) {
+        u32 newCap = d->cap ? d->cap * 2 : 64;
+        tp_task* tasks = malloc(newCap * sizeof(tp_task));
+        assert(tasks);
+        for(u32 i = d->head; i != d->tail; i++) {
+            tasks[i & (newCap - 1)] = d->tasks[i & (d->cap - 1)];
+        }
+        if(d->tasks) free(d->tasks);
+        d->tasks = tasks;
+        d->cap = newCap;
+    }
+    d->tasks[d->tail & (d->cap - 1)] = task;
+    d->tail += 1;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static i32
+tp_deque_pop(tp_deque* d, tp_task* task) {
+
+    i32 found = 0;
+    pthread_mutex_lock(&d->lock);
+    if(d->tail != d->head) {
+        d->tail -= 1;
+        *task = d->tasks[d->tail & (d->cap - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static i32
+tp_deque_steal(tp_deque* d, tp_task* task) {
+
+    i32 found = 0;
+    // don't queue behind the owner, just move on to the next victim
+    if(pthread_mutex_trylock(&d->lock) != 0) return 0;
+    if(d->tail != d->head) {
+        *task = d->tasks[d->head & (d->cap - 1)];
+        d->head += 1;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static i32
+tp_find_task(threadpool* pool, u32 self, tp_task* task) {
+
+    if(tp_deque_pop(&pool->deques[self], task)) return 1;
+    for(u32 i = 1; i < pool->count; i++) {
+        if(tp_deque_steal(&pool->deques[(self + i) % pool->count], task)) return 1;
+    }
+    return 0;
+}
+
+static void*
+tp_worker_main(void* arg) {
+
+    tp_worker* worker = arg;
+    threadpool* pool = worker->pool;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->workAvailable, &pool->lock);
+        }
+        if(pool->queued == 0 && pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        tp_task task;
+        if(!tp_find_task(pool, worker->index, &task)) {
+            // someone else got it first or victim was busy, try again
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued -= 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.fn(task.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= 1;
+        if(pool->pending == 0) {
+            pthread_cond_broadcast(&pool->allDone);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void
+threadpool_init(threadpool* pool, u32 threads) {
+
+    memset(pool, 0, sizeof(*pool));
+    pool->count = threads ? threads : 1;
+    pool->deques = calloc(pool->count, sizeof(tp_deque));
+    pool->workers = calloc(pool->count, sizeof(tp_worker));
+    assert(pool->deques && pool->workers);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workAvailable, NULL);
+    pthread_cond_init(&pool->allDone, NULL);
+
+    for(u32 i = 0; i < pool->count; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    for(u32 i = 0; i < pool->count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if(pthread_create(&pool->workers[i].thread, NULL, tp_worker_main, &pool->workers[i]) != 0) {
+            printf("failed to create worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// tasks are spread round robin, stealing evens out the rest
+static void
+threadpool_submit(threadpool* pool, threadpool_fn fn, void* arg) {
+
+    pthread_mutex_lock(&pool->lock);
+    u32 queue = pool->nextQueue++ % pool->count;
+    pool->pending += 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    tp_deque_push(&pool->deques[queue], (tp_task){fn, arg});
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued += 1;
+    pthread_cond_signal(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+threadpool_wait(threadpool* pool) {
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending != 0) {
+        pthread_cond_wait(&pool->allDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+threadpool_dispose(threadpool* pool) {
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(u32 i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for(u32 i = 0; i < pool->count; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        if(pool->deques[i].tasks) free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workAvailable);
+    pthread_cond_destroy(&pool->allDone);
+    free(pool->deques);
+    free(pool->workers);
+}
+
+#endif /* THREADPOOL_H */
@@ -0,0 +1,104 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "defs.h"
+
+// Execution trace. Handlers that used to print record a binary entry
+// (pc, opcode, I, sp and all registers) into a fixed ring in the machine
+// instead, which costs a few stores. Nothing is written anywhere until a
+// fatal trap or someone asks for it; chip8-tracedump turns a dump back
+// into text. Independent of chip8.h so the decoder can include it alone.
+
+#define CHIP8_TRACE_SIZE    1024 // entries, power of two
+#define CHIP8_TRACE_MAGIC   0x52543843u // "C8TR"
+#define CHIP8_TRACE_VERSION 1
+
+#define CHIP8_TRACE_EVENTS(FN) \
+    FN(shift_right)   /* 8xy6 */ \
+    FN(sub_reverse)   /* 8xy7 */ \
+    FN(font)          /* Fx29 */ \
+    FN(store)         /* Fx55 */ \
+    FN(key_wait)      /* Fx0A without a key, repeats are folded */ \
+    FN(marker)        /* dumped on request */ \
+    FN(trap_opcode) \
+    FN(trap_register) \
+    FN(trap_memory) \
+    FN(trap_key) \
+    FN(trap_font) \
+    FN(trap_stack)
+
+#define CHIP8_TRACE_ENUM(NAME) chip8_trace_##NAME,
+typedef enum chip8_trace_event {
+    CHIP8_TRACE_EVENTS(CHIP8_TRACE_ENUM)
+    chip8_trace_event_count
+} chip8_trace_event;
+#undef CHIP8_TRACE_ENUM
+
+typedef struct chip8_trace_entry {
+    u32 sequence; // running count, tells the order after the ring wrapped
+    u32 repeat;   // times this entry happened back to back
+    u16 pc;
+    u16 opcode;
+    u16 I;
+    u8  event;    // chip8_trace_event
+    u8  sp;
+    u8  V[16];
+} chip8_trace_entry;
+
+typedef struct chip8_trace {
+    chip8_trace_entry entries[CHIP8_TRACE_SIZE];
+    u32               sequence; // entries ever recorded
+} chip8_trace;
+
+typedef struct chip8_trace_header {
+    u32 magic;
+    u32 version;
+    u32 entrySize;
+    u32 count;
+} chip8_trace_header;
+
+static inline void
+chip8_trace_record(chip8_trace* t, chip8_trace_event event, u16 pc, u16 opcode,
+        u16 I, u8 sp, const u8* V) {
+    if(t->sequence) {
+        chip8_trace_entry* last = &t->entries[(t->sequence - 1) & (CHIP8_TRACE_SIZE - 1)];
+        if(last->event == event && last->pc == pc && event == chip8_trace_key_wait) {
+            last->repeat += 1;
+            return;
+        }
+    }
+    chip8_trace_entry* e = &t->entries[t->sequence & (CHIP8_TRACE_SIZE - 1)];
+    e->sequence = t->sequence++;
+    e->repeat = 1;
+    e->pc = pc;
+    e->opcode = opcode;
+    e->I = I;
+    e->event = (u8)event;
+    e->sp = sp;
+    memcpy(e->V, V, sizeof(e->V));
+}
+
+// Writes the ring oldest first.
+static i32
+chip8_trace_dump(const chip8_trace* t, const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        printf("failed to open %s\n", path);
+        return 0;
+    }
+    u32 count = t->sequence < CHIP8_TRACE_SIZE ? t->sequence : CHIP8_TRACE_SIZE;
+    chip8_trace_header header = { CHIP8_TRACE_MAGIC, CHIP8_TRACE_VERSION, sizeof(chip8_trace_entry), count };
+    i32 ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for(u32 i = t->sequence - count; ok && i != t->sequence; i++) {
+        ok = fwrite(&t->entries[i & (CHIP8_TRACE_SIZE - 1)], sizeof(chip8_trace_entry), 1, fp) == 1;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if(!ok) printf("failed to write %s\n", path);
+    return ok;
+}
+
+#endif /* TRACE_H */
@@ -0,0 +1,67 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+// Decodes a trace dump (trace.h) into one line of text per entry, oldest
+// first.
+//
+//  chip8-tracedump trace...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "trace.h"
+
+#define CHIP8_TRACE_NAME(NAME) #NAME,
+static const char* chip8TraceEventNames[] = { CHIP8_TRACE_EVENTS(CHIP8_TRACE_NAME) };
+#undef CHIP8_TRACE_NAME
+
+static i32
+tracedump_file(const char* path) {
+
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        printf("%s not found\n", path);
+        return 0;
+    }
+    chip8_trace_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CHIP8_TRACE_MAGIC ||
+            header.version != CHIP8_TRACE_VERSION || header.entrySize != sizeof(chip8_trace_entry)) {
+        printf("%s is not a trace dump\n", path);
+        fclose(fp);
+        return 0;
+    }
+
+    printf("# %s, %u entries\n# sequence event pc opcode I sp V0..VF repeat\n", path, header.count);
+    for(u32 i = 0; i < header.count; i++) {
+        chip8_trace_entry e;
+        if(fread(&e, sizeof(e), 1, fp) != 1) {
+            printf("# truncated after %u entries\n", i);
+            break;
+        }
+        const char* name = e.event < chip8_trace_event_count ? chip8TraceEventNames[e.event] : "unknown";
+        printf("%u %s %03X %04X %03X %u", e.sequence, name, e.pc, e.opcode, e.I, e.sp);
+        for(u32 r = 0; r < 16; r++) {
+            printf(r ? ",%02X" : " %02X", e.V[r]);
+        }
+        printf(" %u\n", e.repeat);
+    }
+    fclose(fp);
+    return 1;
+}
+
+int
+main(int argc, char** argv) {
+
+    if(argc < 2) {
+        printf("usage: %s trace...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    i32 ok = 1;
+    for(int i = 1; i < argc; i++) {
+        ok = tracedump_file(argv[i]) && ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
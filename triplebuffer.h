@@ -0,0 +1,69 @@
+/************************************************************
+ * Check license.txt in project root for license information *
+ *********************************************************** */
+
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include "defs.h"
+#include "chip8.h"
+
+// Lock free single producer, single consumer frame handoff. The emulator
+// owns one buffer, the renderer owns another, and the third sits in the
+// middle. Publishing swaps the producer buffer with the middle one and
+// acquiring swaps the consumer buffer with it. Neither side ever waits,
+// and the consumer always gets the newest finished frame. Frames that were
+// published but never picked up are dropped.
+
+#define TB_FRESH 0x4 // middle holds a frame the consumer hasn't seen yet
+
+typedef struct chip8_frame {
+    u64 canvas[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT]; // as in struct chip8
+    u64 sequence;
+    u64 inputTime; // the key press this frame answers, sched_now() ns, 0 for none
+    u8  hires;
+} chip8_frame;
+
+typedef struct triple_buffer {
+    chip8_frame frames[3];
+    u32         back;   // producer only
+    u32         front;  // consumer only
+    u32         middle; // shared, index | TB_FRESH
+} triple_buffer;
+
+static void
+tb_init(triple_buffer* tb) {
+    memset(tb, 0, sizeof(*tb));
+    tb->back = 0;
+    tb->middle = 1;
+    tb->front = 2;
+}
+
+// buffer the producer can fill, valid until the next tb_publish
+static chip8_frame*
+tb_back(triple_buffer* tb) {
+    return &tb->frames[tb->back];
+}
+
+static void
+tb_publish(triple_buffer* tb) {
+    u32 old = __atomic_exchange_n(&tb->middle, tb->back | TB_FRESH, __ATOMIC_ACQ_REL);
+    tb->back = old & 0x3;
+}
+
+// Returns 1 and moves the newest frame to the front when there is one,
+// otherwise leaves the front frame as it was.
+static i32
+tb_acquire(triple_buffer* tb) {
+    if(!(__atomic_load_n(&tb->middle, __ATOMIC_ACQUIRE) & TB_FRESH)) return 0;
+    u32 old = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL);
+    tb->front = old & 0x3;
+    return 1;
+}
+
+static const chip8_frame*
+tb_front(const triple_buffer* tb) {
+    return &tb->frames[tb->front];
+}
+
+#endif /* TRIPLEBUFFER_H */